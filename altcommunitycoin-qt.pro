@@ -154,12 +154,14 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/editaddressdialog.h \
     src/qt/bitcoinaddressvalidator.h \
     src/alert.h \
+    src/blockfilemap.h \
     src/addrman.h \
     src/base58.h \
     src/bignum.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
@@ -252,12 +254,15 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editaddressdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
+    src/blockfilemap.cpp \
     src/chainparams.cpp \
     src/version.cpp \
     src/sync.cpp \
     src/txmempool.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/skunkhashxn.cpp \
+    src/sha256xn.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
@@ -0,0 +1,68 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "util.h"
+
+#include <limits>
+
+using namespace std;
+
+benchmark::BenchRunner::BenchmarkMap &benchmark::BenchRunner::benchmarks()
+{
+    static std::map<std::string, benchmark::BenchFunction> benchmarks_map;
+    return benchmarks_map;
+}
+
+static double gettimedouble(void)
+{
+    return GetTimeMicros() * 0.000001;
+}
+
+benchmark::BenchRunner::BenchRunner(std::string name, benchmark::BenchFunction func)
+{
+    benchmarks().insert(std::make_pair(name, func));
+}
+
+void benchmark::BenchRunner::RunAll(const std::string& strFilter, double elapsedTimeForOne)
+{
+    printf("Benchmark,count,min,max,average,items/s\n");
+
+    for (BenchmarkMap::iterator it = benchmarks().begin(); it != benchmarks().end(); ++it)
+    {
+        if (it->first.find(strFilter) == std::string::npos)
+            continue;
+        State state(it->first, elapsedTimeForOne);
+        BenchFunction& func = it->second;
+        func(state);
+    }
+}
+
+bool benchmark::State::KeepRunning()
+{
+    double now;
+    if (count == 0) {
+        beginTime = now = gettimedouble();
+    }
+    else {
+        now = gettimedouble();
+        double elapsedOne = now - lastTime;
+        if (elapsedOne > maxTime) maxTime = elapsedOne;
+        if (elapsedOne < minTime) minTime = elapsedOne;
+    }
+    lastTime = now;
+    ++count;
+
+    if (now - beginTime < maxElapsed) return true; // Keep going
+
+    --count;
+
+    // Output results
+    double average = (now - beginTime) / count;
+    double itemsPerSec = nItemsPerIteration > 0 ? nItemsPerIteration / average : 0;
+    printf("%s,%d,%f,%f,%f,%.0f\n", name.c_str(), (int)count, minTime, maxTime, average, itemsPerSec);
+
+    return false;
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <limits>
+#include <map>
+#include <string>
+
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+// Simple micro-benchmarking framework; API mostly modeled after Google Benchmark.
+//
+// Define a benchmark with a function and the BENCHMARK macro:
+//
+// static void CODE_TO_TIME(benchmark::State& state)
+// {
+//     ... do any setup needed...
+//     while (state.KeepRunning()) {
+//        ... do stuff you want to time...
+//     }
+//     ... do any cleanup needed...
+// }
+//
+// BENCHMARK(CODE_TO_TIME);
+//
+// A benchmark that processes a known number of items (hashes, transactions,
+// bytes) per iteration can say so with SetItemsPerIteration() and gets an
+// items/s column in the report.
+
+namespace benchmark {
+
+    class State {
+        std::string name;
+        double maxElapsed;
+        double beginTime;
+        double lastTime, minTime, maxTime;
+        int64_t count;
+        int64_t nItemsPerIteration;
+    public:
+        State(std::string _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), count(0), nItemsPerIteration(0) {
+            minTime = std::numeric_limits<double>::max();
+            maxTime = 0;
+        }
+        bool KeepRunning();
+        void SetItemsPerIteration(int64_t nItems) { nItemsPerIteration = nItems; }
+    };
+
+    typedef boost::function<void(State&)> BenchFunction;
+
+    class BenchRunner
+    {
+        typedef std::map<std::string, BenchFunction> BenchmarkMap;
+        static BenchmarkMap &benchmarks();
+
+    public:
+        BenchRunner(std::string name, BenchFunction func);
+
+        // Runs every benchmark whose name contains strFilter
+        static void RunAll(const std::string& strFilter = "", double elapsedTimeForOne = 1.0);
+    };
+}
+
+// BENCHMARK(foo) expands to:  benchmark::BenchRunner bench_11foo("foo", foo);
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
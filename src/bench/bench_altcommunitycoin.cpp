@@ -0,0 +1,22 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "util.h"
+
+// Usage: bench_altcommunitycoin [filter [seconds]]
+//
+// Runs every benchmark whose name contains filter, each for about the given
+// number of seconds (default 1).
+int main(int argc, char** argv)
+{
+    std::string strFilter = argc > 1 ? argv[1] : "";
+    double nSeconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+    fPrintToConsole = true;
+    benchmark::BenchRunner::RunAll(strFilter, nSeconds);
+
+    return 0;
+}
@@ -0,0 +1,552 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+// Connects a block of about 5 MB of two-input, two-output transactions and
+// the block that creates the outputs it spends, both in one txdb
+// transaction as Reorganize connects a branch, so every input of the big
+// block is read through the pending changes. The scripts have the sizes of
+// pay-to-pubkey-hash but are trivially true, so the time goes to
+// ConnectBlock's txdb and bookkeeping work rather than to signatures.
+static const unsigned int BENCH_BLOCK_TXS = 12800;
+static const unsigned int BENCH_FUNDING_OUTPUTS = 256;
+static const unsigned int BENCH_BLOCK_TIME = 1500000000;
+
+// Layouts of the pending changes and the tx index that the shipped txdb no
+// longer uses, kept here to compare against. CBenchDB sits in place of the
+// LevelDB under CTxDB with the write-back cache turned off, so every change
+// ConnectBlock makes outside of a CTxDB transaction reaches it at once and
+// stays pending there until Discard():
+// - with fScan the pending changes are a WriteBatch that every read walks,
+//   as reads inside a transaction did before CTxDBBatch was indexed;
+// - with fTxIndexV1 the tx index records keep where every output was spent
+//   in the record itself, as before DATABASE_VERSION 70512.
+class CTxIndexV1
+{
+public:
+    CDiskTxPos pos;
+    std::vector<CDiskTxPos> vSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(pos);
+        READWRITE(vSpent);
+    )
+};
+
+class CBatchScanner : public leveldb::WriteBatch::Handler {
+public:
+    std::string needle;
+    bool *deleted;
+    std::string *foundValue;
+    bool foundEntry;
+
+    CBatchScanner() : foundEntry(false) {}
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        if (key.ToString() == needle) {
+            foundEntry = true;
+            *deleted = false;
+            *foundValue = value.ToString();
+        }
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        if (key.ToString() == needle) {
+            foundEntry = true;
+            *deleted = true;
+        }
+    }
+};
+
+class CBenchDB : public leveldb::DB
+{
+public:
+    leveldb::DB* pdbBase;
+
+    CBenchDB(leveldb::DB* pdbBaseIn, bool fScanIn, bool fTxIndexV1In) : pdbBase(pdbBaseIn), fScan(fScanIn), fTxIndexV1(fTxIndexV1In)
+    {
+        CTxDBKey keyTx(string("tx")), keyTxSpent(string("txspent"));
+        strPrefixTx.assign(keyTx.GetSlice().data(), keyTx.size());
+        strPrefixTxSpent.assign(keyTxSpent.GetSlice().data(), keyTxSpent.size());
+    }
+
+    // Writes the pending changes to the database underneath
+    bool Commit()
+    {
+        leveldb::WriteBatch batch;
+        if (fScan)
+            batch = batchScan;
+        for (map<string, pair<bool, string> >::const_iterator mi = mapPending.begin(); mi != mapPending.end(); ++mi)
+        {
+            if ((*mi).second.first)
+                batch.Delete((*mi).first);
+            else
+                batch.Put((*mi).first, (*mi).second.second);
+        }
+        Discard();
+        return pdbBase->Write(leveldb::WriteOptions(), &batch).ok();
+    }
+
+    void Discard()
+    {
+        batchScan.Clear();
+        mapPending.clear();
+        mapSpentPending.clear();
+    }
+
+    virtual leveldb::Status Put(const leveldb::WriteOptions& options, const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        leveldb::WriteBatch batch;
+        batch.Put(key, value);
+        return Write(options, &batch);
+    }
+
+    virtual leveldb::Status Delete(const leveldb::WriteOptions& options, const leveldb::Slice& key)
+    {
+        leveldb::WriteBatch batch;
+        batch.Delete(key);
+        return Write(options, &batch);
+    }
+
+    virtual leveldb::Status Write(const leveldb::WriteOptions& options, leveldb::WriteBatch* updates)
+    {
+        CPendingWriter writer(this);
+        leveldb::Status status = updates->Iterate(&writer);
+        if (status.ok() && !writer.fOk)
+            return leveldb::Status::Corruption("CBenchDB::Write() : tx index translation failed");
+        return status;
+    }
+
+    virtual leveldb::Status Get(const leveldb::ReadOptions& options, const leveldb::Slice& key, std::string* value)
+    {
+        if (!fTxIndexV1)
+            return GetRaw(key, value);
+
+        // Present the inline records in the current format
+        uint256 hash;
+        unsigned int n;
+        if (ParseTxKey(key, hash))
+        {
+            CTxIndex txindex;
+            leveldb::Status status = ReadTxIndexV1(key, txindex);
+            if (!status.ok())
+                return status;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << txindex;
+            value->assign(ssValue.begin(), ssValue.end());
+            return status;
+        }
+        if (ParseTxSpentKey(key, hash, n))
+        {
+            CTxIndex txindex;
+            CTxDBKey keyTx(make_pair(string("tx"), hash));
+            leveldb::Status status = ReadTxIndexV1(keyTx.GetSlice(), txindex);
+            if (!status.ok())
+                return status;
+            if (n >= txindex.vSpent.size() || txindex.vSpent[n].IsNull())
+                return leveldb::Status::NotFound(leveldb::Slice());
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << CDiskTxPosCompressor(txindex.vSpent[n]);
+            value->assign(ssValue.begin(), ssValue.end());
+            return status;
+        }
+        return GetRaw(key, value);
+    }
+
+    virtual leveldb::Iterator* NewIterator(const leveldb::ReadOptions& options) { return pdbBase->NewIterator(options); }
+    virtual const leveldb::Snapshot* GetSnapshot() { return pdbBase->GetSnapshot(); }
+    virtual void ReleaseSnapshot(const leveldb::Snapshot* snapshot) { pdbBase->ReleaseSnapshot(snapshot); }
+    virtual bool GetProperty(const leveldb::Slice& property, std::string* value) { return pdbBase->GetProperty(property, value); }
+    virtual void GetApproximateSizes(const leveldb::Range* range, int n, uint64_t* sizes) { pdbBase->GetApproximateSizes(range, n, sizes); }
+    virtual void CompactRange(const leveldb::Slice* begin, const leveldb::Slice* end) { pdbBase->CompactRange(begin, end); }
+    virtual void SetCompactionDeferred(bool deferred) { pdbBase->SetCompactionDeferred(deferred); }
+
+private:
+    bool fScan;
+    bool fTxIndexV1;
+    string strPrefixTx, strPrefixTxSpent;
+    leveldb::WriteBatch batchScan;
+    map<string, pair<bool, string> > mapPending;
+    // Spends written ahead of their tx index record, see UpdateTxIndex
+    map<pair<uint256, unsigned int>, CDiskTxPos> mapSpentPending;
+
+    class CPendingWriter : public leveldb::WriteBatch::Handler
+    {
+    public:
+        CBenchDB* pdb;
+        bool fOk;
+
+        CPendingWriter(CBenchDB* pdbIn) : pdb(pdbIn), fOk(true) {}
+
+        virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+        {
+            fOk = pdb->PutPending(key, value) && fOk;
+        }
+
+        virtual void Delete(const leveldb::Slice& key)
+        {
+            pdb->SetPending(key, leveldb::Slice(), true);
+        }
+    };
+
+    bool ParseTxKey(const leveldb::Slice& key, uint256& hash) const
+    {
+        if (key.size() != strPrefixTx.size() + sizeof(hash) || memcmp(key.data(), strPrefixTx.data(), strPrefixTx.size()) != 0)
+            return false;
+        memcpy(hash.begin(), key.data() + strPrefixTx.size(), sizeof(hash));
+        return true;
+    }
+
+    bool ParseTxSpentKey(const leveldb::Slice& key, uint256& hash, unsigned int& n) const
+    {
+        if (key.size() != strPrefixTxSpent.size() + sizeof(hash) + sizeof(n) || memcmp(key.data(), strPrefixTxSpent.data(), strPrefixTxSpent.size()) != 0)
+            return false;
+        CSpanReader ssKey(key.data() + strPrefixTxSpent.size(), key.data() + key.size(), SER_DISK, CLIENT_VERSION);
+        ssKey >> hash >> n;
+        return true;
+    }
+
+    void SetPending(const leveldb::Slice& key, const leveldb::Slice& value, bool fErased)
+    {
+        if (fScan)
+        {
+            if (fErased)
+                batchScan.Delete(key);
+            else
+                batchScan.Put(key, value);
+            return;
+        }
+        pair<bool, string>& entry = mapPending[key.ToString()];
+        entry.first = fErased;
+        entry.second.assign(value.data(), value.size());
+    }
+
+    leveldb::Status GetRaw(const leveldb::Slice& key, std::string* value)
+    {
+        if (fScan)
+        {
+            bool fErased = false;
+            CBatchScanner scanner;
+            scanner.needle = key.ToString();
+            scanner.deleted = &fErased;
+            scanner.foundValue = value;
+            leveldb::Status status = batchScan.Iterate(&scanner);
+            if (!status.ok())
+                return status;
+            if (scanner.foundEntry)
+                return fErased ? leveldb::Status::NotFound(leveldb::Slice()) : leveldb::Status::OK();
+        }
+        else
+        {
+            map<string, pair<bool, string> >::const_iterator mi = mapPending.find(key.ToString());
+            if (mi != mapPending.end())
+            {
+                if ((*mi).second.first)
+                    return leveldb::Status::NotFound(leveldb::Slice());
+                *value = (*mi).second.second;
+                return leveldb::Status::OK();
+            }
+        }
+        return pdbBase->Get(leveldb::ReadOptions(), key, value);
+    }
+
+    leveldb::Status ReadTxIndexV1(const leveldb::Slice& key, CTxIndex& txindex)
+    {
+        string strValue;
+        leveldb::Status status = GetRaw(key, &strValue);
+        if (!status.ok())
+            return status;
+        CTxIndexV1 txindexOld;
+        try {
+            CSpanReader(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION) >> txindexOld;
+        }
+        catch (std::exception &e) {
+            return leveldb::Status::Corruption("CBenchDB::ReadTxIndexV1() : deserialize error");
+        }
+        txindex.pos = txindexOld.pos;
+        txindex.vSpent = txindexOld.vSpent;
+        return status;
+    }
+
+    // Folds the spends of a tx index record in the current format into the
+    // inline record, taking the spends that were not read from the record
+    // it replaces
+    bool PutPending(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        uint256 hash;
+        unsigned int n;
+        if (!fTxIndexV1)
+        {
+            SetPending(key, value, false);
+            return true;
+        }
+        if (ParseTxSpentKey(key, hash, n))
+        {
+            CDiskTxPos posSpent;
+            CDiskTxPosCompressor compressor(posSpent);
+            CSpanReader(value.data(), value.data() + value.size(), SER_DISK, CLIENT_VERSION) >> compressor;
+            mapSpentPending[make_pair(hash, n)] = posSpent;
+            return true;
+        }
+        if (!ParseTxKey(key, hash))
+        {
+            SetPending(key, value, false);
+            return true;
+        }
+
+        CTxIndex txindex, txindexPrev;
+        CSpanReader(value.data(), value.data() + value.size(), SER_DISK, CLIENT_VERSION) >> txindex;
+        bool fPrev = false;
+        CTxIndexV1 txindexOld;
+        txindexOld.pos = txindex.pos;
+        txindexOld.vSpent = txindex.vSpent;
+        for (n = 0; n < txindexOld.vSpent.size(); n++)
+        {
+            map<pair<uint256, unsigned int>, CDiskTxPos>::iterator mi = mapSpentPending.find(make_pair(hash, n));
+            if (mi != mapSpentPending.end())
+            {
+                txindexOld.vSpent[n] = (*mi).second;
+                mapSpentPending.erase(mi);
+            }
+            else if (txindexOld.vSpent[n] == CTxIndex::SpentPosUnread())
+            {
+                if (!fPrev && !ReadTxIndexV1(key, txindexPrev).ok())
+                    return false;
+                fPrev = true;
+                if (n >= txindexPrev.vSpent.size())
+                    return false;
+                txindexOld.vSpent[n] = txindexPrev.vSpent[n];
+            }
+        }
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << txindexOld;
+        SetPending(key, leveldb::Slice(&ssValue[0], ssValue.size()), false);
+        return true;
+    }
+};
+
+extern leveldb::DB* txdb;
+
+class CConnectBlockBench
+{
+public:
+    CBlockIndex* pindexBestSaved;
+    uint256 hashGenesis, hashFunding, hashSpending;
+    CBlockIndex indexGenesis, indexFunding, indexSpending;
+    CBlock blockFunding, blockSpending;
+    CBenchDB* pdbBench;
+
+    // Without fBenchDB the blocks are connected through the shipped txdb
+    // alone, with the write-back cache and an indexed transaction batch
+    CConnectBlockBench(bool fBenchDB, bool fScan, bool fTxIndexV1);
+    ~CConnectBlockBench();
+
+    bool Connect();
+
+private:
+    static CScript ScriptPubKey(unsigned int n);
+    static CScript ScriptSig();
+    static CTransaction Spend(const vector<COutPoint>& vPrevout, unsigned int nOutputs, int64_t nValue, unsigned int nTime);
+    static void Finish(CBlock& block, const uint256& hashPrev, unsigned int nTime, int nHeight);
+};
+
+CScript CConnectBlockBench::ScriptPubKey(unsigned int n)
+{
+    return CScript() << vector<unsigned char>(20, (unsigned char)n) << OP_DROP << OP_2DROP << OP_TRUE;
+}
+
+CScript CConnectBlockBench::ScriptSig()
+{
+    return CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+}
+
+CTransaction CConnectBlockBench::Spend(const vector<COutPoint>& vPrevout, unsigned int nOutputs, int64_t nValue, unsigned int nTime)
+{
+    CTransaction tx;
+    tx.nTime = nTime;
+    BOOST_FOREACH(const COutPoint& prevout, vPrevout)
+        tx.vin.push_back(CTxIn(prevout, ScriptSig()));
+    for (unsigned int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut(nValue, ScriptPubKey(i)));
+    return tx;
+}
+
+void CConnectBlockBench::Finish(CBlock& block, const uint256& hashPrev, unsigned int nTime, int nHeight)
+{
+    CTransaction txCoinbase;
+    txCoinbase.nTime = nTime;
+    txCoinbase.vin.push_back(CTxIn());
+    txCoinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    txCoinbase.vout.push_back(CTxOut(0, CScript() << OP_TRUE));
+    block.vtx.insert(block.vtx.begin(), txCoinbase);
+
+    block.hashPrevBlock = hashPrev;
+    block.nTime = nTime;
+    block.nBits = Params().ProofOfWorkLimit().GetCompact();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    while (!CheckProofOfWork(block.GetPoWHash(), block.nBits))
+        block.nNonce++;
+}
+
+CConnectBlockBench::CConnectBlockBench(bool fBenchDB, bool fScan, bool fTxIndexV1)
+{
+    SelectParams(CChainParams::REGTEST);
+    if (!mapArgs.count("-datadir"))
+    {
+        boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_connectblock_%lu", (unsigned long)GetTime());
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+    }
+    boost::filesystem::remove_all(GetDataDir() / "txleveldb");
+    pdbBench = NULL;
+    if (fBenchDB)
+        mapArgs["-dbcache"] = "0";
+    CTxDB("cr+");
+    if (fBenchDB)
+        txdb = pdbBench = new CBenchDB(txdb, fScan, fTxIndexV1);
+
+    CTxDB txdbFunding("r+");
+
+    // Outputs on disk that the funding block spends, one per transaction
+    unsigned int nFundingTxs = BENCH_BLOCK_TXS * 2 / BENCH_FUNDING_OUTPUTS;
+    txdbFunding.TxnBegin();
+    for (unsigned int i = 0; i < nFundingTxs; i++)
+    {
+        CTransaction tx = Spend(vector<COutPoint>(1, COutPoint(Hash(BEGIN(i), END(i)), 0)), 1, 1000 * COIN, BENCH_BLOCK_TIME - 1000);
+        CDiskTxPos pos(1, 0, 100 + i);
+        if (!txdbFunding.AddTxIndex(tx, pos, 0) || !txdbFunding.WriteCoin(COutPoint(tx.GetHash(), 0), CCoin(tx, 0, pos, 0, tx.nTime)))
+            throw runtime_error("CConnectBlockBench() : writing the coin set failed");
+        blockFunding.vtx.push_back(Spend(vector<COutPoint>(1, COutPoint(tx.GetHash(), 0)), BENCH_FUNDING_OUTPUTS, 3 * COIN, BENCH_BLOCK_TIME));
+    }
+    if (!txdbFunding.TxnCommit())
+        throw runtime_error("CConnectBlockBench() : TxnCommit failed");
+    CTxDB::Flush();
+    if (pdbBench && !pdbBench->Commit())
+        throw runtime_error("CConnectBlockBench() : writing the coin set failed");
+
+    hashGenesis = Hash(BEGIN(BENCH_BLOCK_TIME), END(BENCH_BLOCK_TIME));
+    Finish(blockFunding, hashGenesis, BENCH_BLOCK_TIME, 1);
+    hashFunding = blockFunding.GetHash();
+
+    for (unsigned int i = 0; i < BENCH_BLOCK_TXS; i++)
+    {
+        const uint256 hashPrev = blockFunding.vtx[1 + 2 * i / BENCH_FUNDING_OUTPUTS].GetHash();
+        vector<COutPoint> vPrevout;
+        vPrevout.push_back(COutPoint(hashPrev, 2 * i % BENCH_FUNDING_OUTPUTS));
+        vPrevout.push_back(COutPoint(hashPrev, 2 * i % BENCH_FUNDING_OUTPUTS + 1));
+        blockSpending.vtx.push_back(Spend(vPrevout, 2, 2 * COIN, BENCH_BLOCK_TIME + 60));
+    }
+    Finish(blockSpending, hashFunding, BENCH_BLOCK_TIME + 60, 2);
+    hashSpending = blockSpending.GetHash();
+    assert(::GetSerializeSize(blockSpending, SER_NETWORK, PROTOCOL_VERSION) <= MAX_BLOCK_SIZE);
+
+    indexGenesis.phashBlock = &hashGenesis;
+    indexGenesis.nTime = BENCH_BLOCK_TIME - 60;
+    indexFunding.phashBlock = &hashFunding;
+    indexFunding.pprev = &indexGenesis;
+    indexFunding.nHeight = 1;
+    indexFunding.nFile = 1;
+    indexFunding.nBlockPos = 100000;
+    indexFunding.nTime = blockFunding.nTime;
+    indexSpending.phashBlock = &hashSpending;
+    indexSpending.pprev = &indexFunding;
+    indexSpending.nHeight = 2;
+    indexSpending.nFile = 1;
+    indexSpending.nBlockPos = 200000;
+    indexSpending.nTime = blockSpending.nTime;
+
+    pindexBestSaved = pindexBest;
+    pindexBest = &indexGenesis;
+}
+
+CConnectBlockBench::~CConnectBlockBench()
+{
+    pindexBest = pindexBestSaved;
+    if (pdbBench)
+    {
+        txdb = pdbBench->pdbBase;
+        delete pdbBench;
+    }
+    CTxDB().Close();
+    boost::filesystem::remove_all(GetDataDir() / "txleveldb");
+    mapArgs.erase("-dbcache");
+    SelectParams(CChainParams::MAIN);
+}
+
+// Both blocks go into one transaction that is thrown away afterwards, so
+// every round starts from the same coin set. With a CBenchDB the pending
+// changes it holds make up the transaction.
+bool CConnectBlockBench::Connect()
+{
+    CTxDB txdb;
+    if (pdbBench)
+    {
+        bool fOk = blockFunding.ConnectBlock(txdb, &indexFunding) && blockSpending.ConnectBlock(txdb, &indexSpending);
+        pdbBench->Discard();
+        return fOk;
+    }
+    if (!txdb.TxnBegin())
+        return false;
+    bool fOk = blockFunding.ConnectBlock(txdb, &indexFunding) && blockSpending.ConnectBlock(txdb, &indexSpending);
+    txdb.TxnAbort();
+    return fOk;
+}
+
+static void ConnectBlock(benchmark::State& state, bool fBenchDB, bool fScan, bool fTxIndexV1)
+{
+    CConnectBlockBench bench(fBenchDB, fScan, fTxIndexV1);
+    state.SetItemsPerIteration(bench.blockFunding.vtx.size() + bench.blockSpending.vtx.size());
+    while (state.KeepRunning())
+    {
+        if (!bench.Connect())
+        {
+            LogPrintf("ConnectBlock bench : connecting the blocks failed\n");
+            break;
+        }
+    }
+}
+
+// Through the shipped txdb: reads inside the transaction look the key up
+// in the batch index, and the tx index keeps spends in records of their own
+static void ConnectBlockShipped(benchmark::State& state)
+{
+    ConnectBlock(state, false, false, false);
+}
+
+// The other three go through a CBenchDB and compare with each other: the
+// pending changes kept by key,
+static void ConnectBlockPendingMap(benchmark::State& state)
+{
+    ConnectBlock(state, true, false, false);
+}
+
+// as one WriteBatch that every read walks,
+static void ConnectBlockLinearScan(benchmark::State& state)
+{
+    ConnectBlock(state, true, true, false);
+}
+
+// and kept by key with the spends inside the tx index records
+static void ConnectBlockTxIndexV1(benchmark::State& state)
+{
+    ConnectBlock(state, true, false, true);
+}
+
+BENCHMARK(ConnectBlockShipped);
+BENCHMARK(ConnectBlockPendingMap);
+BENCHMARK(ConnectBlockLinearScan);
+BENCHMARK(ConnectBlockTxIndexV1);
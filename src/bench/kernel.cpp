@@ -0,0 +1,79 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "kernel.h"
+
+#include <vector>
+
+// Kernels per iteration: 60 chunks of the coins CreateCoinStake tries. Under
+// protocol v2 SignBlock searches a single timestamp, so a chunk holds one
+// kernel per coin.
+static const unsigned int BENCH_CHUNKS = 60;
+static const unsigned int BENCH_KERNELS = STAKE_KERNEL_BATCH_COINS * BENCH_CHUNKS;
+
+struct CKernelTrace
+{
+    uint256 bnStakeModifierV2;
+    std::vector<COutPoint> vPrevout;
+    std::vector<unsigned int> vTime;
+
+    CKernelTrace()
+    {
+        unsigned int nSeed = 1;
+        bnStakeModifierV2 = Hash(BEGIN(nSeed), END(nSeed));
+        for (unsigned int i = 0; i < BENCH_KERNELS; i++)
+        {
+            vPrevout.push_back(COutPoint(Hash(BEGIN(i), END(i)), i % 3));
+            vTime.push_back(1500000000);
+        }
+    }
+};
+
+// One CDataStream and one Hash() per kernel, as CheckStakeKernelHashV2
+static void StakeKernelScalar(benchmark::State& state)
+{
+    CKernelTrace trace;
+    unsigned int nTimeTxPrev = 1400000000;
+    state.SetItemsPerIteration(BENCH_KERNELS);
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < BENCH_KERNELS; i++)
+        {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << trace.bnStakeModifierV2 << nTimeTxPrev << trace.vPrevout[i].hash << trace.vPrevout[i].n << trace.vTime[i];
+            Hash(ss.begin(), ss.end());
+        }
+    }
+}
+
+// The same kernels serialized into one buffer and hashed with SHA256DxN one
+// chunk at a time, as CStakeKernelCache::CheckKernels does
+static void StakeKernelBatch(benchmark::State& state)
+{
+    CKernelTrace trace;
+    unsigned int nTimeTxPrev = 1400000000;
+    std::vector<unsigned char> vKernels(BENCH_KERNELS * STAKE_KERNEL_SIZE_V3);
+    std::vector<uint256> vHashes(BENCH_KERNELS);
+    state.SetItemsPerIteration(BENCH_KERNELS);
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < BENCH_KERNELS; i++)
+        {
+            unsigned char* p = &vKernels[i * STAKE_KERNEL_SIZE_V3];
+            memcpy(p, trace.bnStakeModifierV2.begin(), 32);
+            memcpy(p + 32, &nTimeTxPrev, 4);
+            memcpy(p + 36, trace.vPrevout[i].hash.begin(), 32);
+            memcpy(p + 68, &trace.vPrevout[i].n, 4);
+            memcpy(p + 72, &trace.vTime[i], 4);
+        }
+        for (unsigned int c = 0; c < BENCH_CHUNKS; c++)
+            SHA256DxN(&vKernels[c * STAKE_KERNEL_BATCH_COINS * STAKE_KERNEL_SIZE_V3], STAKE_KERNEL_SIZE_V3,
+                      STAKE_KERNEL_BATCH_COINS, &vHashes[c * STAKE_KERNEL_BATCH_COINS]);
+    }
+}
+
+BENCHMARK(StakeKernelScalar);
+BENCHMARK(StakeKernelBatch);
@@ -0,0 +1,72 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "main.h"
+
+// Nonces per iteration, as in the internal miner
+static const unsigned int BENCH_NONCES = 256;
+
+static CBlock BenchHeader()
+{
+    CBlock header;
+    header.nVersion = 6;
+    header.hashPrevBlock = Hash(BEGIN(header.nVersion), END(header.nVersion));
+    header.hashMerkleRoot = ~header.hashPrevBlock;
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0fffff;
+    header.nNonce = 0;
+    return header;
+}
+
+// One full SkunkHash5 of the 80-byte header per nonce, as GetPoWHash does
+static void SkunkHash5Header(benchmark::State& state)
+{
+    CBlock header = BenchHeader();
+    state.SetItemsPerIteration(BENCH_NONCES);
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < BENCH_NONCES; i++)
+        {
+            header.GetPoWHash();
+            header.nNonce++;
+        }
+    }
+}
+
+static void SkunkHash5Midstate(benchmark::State& state)
+{
+    CBlock header = BenchHeader();
+    CSkunkHash5Midstate midstate;
+    midstate.Init(BEGIN(header.nVersion));
+    uint256 vHashes[BENCH_NONCES];
+    state.SetItemsPerIteration(BENCH_NONCES);
+    while (state.KeepRunning())
+    {
+        midstate.HashBatch(header.nNonce, BENCH_NONCES, vHashes);
+        header.nNonce += BENCH_NONCES;
+    }
+}
+
+// Headers of different blocks through the multi-lane kernels, the way a
+// batch of headers is checked during validation
+static void SkunkHash5Lanes(benchmark::State& state)
+{
+    CBlock header = BenchHeader();
+    std::vector<unsigned char> vHeaders;
+    for (unsigned int i = 0; i < BENCH_NONCES; i++)
+    {
+        header.hashPrevBlock = Hash(BEGIN(i), END(i));
+        vHeaders.insert(vHeaders.end(), BEGIN(header.nVersion), END(header.nNonce));
+    }
+    uint256 vHashes[BENCH_NONCES];
+    state.SetItemsPerIteration(BENCH_NONCES);
+    while (state.KeepRunning())
+        SkunkHash5xN(&vHeaders[0], 80, BENCH_NONCES, vHashes);
+}
+
+BENCHMARK(SkunkHash5Header);
+BENCHMARK(SkunkHash5Midstate);
+BENCHMARK(SkunkHash5Lanes);
@@ -0,0 +1,103 @@
+// Copyright (c) 2016 The altcommunitycoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+CBlockFileMap blockFileMap;
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifndef WIN32
+    munmap(const_cast<char*>(pdata), nSize);
+#endif
+}
+
+bool CBlockFileMap::IsSupported()
+{
+    // Block files are up to 2GB each, which does not leave enough address
+    // space on 32-bit systems
+#ifdef WIN32
+    return false;
+#else
+    return sizeof(void*) >= 8;
+#endif
+}
+
+boost::shared_ptr<CBlockFileMapping> CBlockFileMap::Get(unsigned int nFile, size_t nMinSize)
+{
+    boost::shared_ptr<CBlockFileMapping> mapping;
+    if (!IsSupported() || nFile < 1 || nFile == (unsigned int)-1)
+        return mapping;
+
+    LOCK(cs);
+    map<unsigned int, CEntry>::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end())
+    {
+        it->second.nLastUsed = ++nUseCounter;
+        if (it->second.mapping->nSize >= nMinSize)
+            return it->second.mapping;
+    }
+
+#ifndef WIN32
+    // Map the file as it is now
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return mapping;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (size_t)st.st_size < nMinSize)
+    {
+        close(fd);
+        return mapping;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        LogPrint("db", "CBlockFileMap::Get() : mmap of block file %u failed\n", nFile);
+        return mapping;
+    }
+    mapping.reset(new CBlockFileMapping(static_cast<const char*>(p), st.st_size));
+#endif
+
+    if (it == mapFiles.end())
+    {
+        // Make room by dropping the mapping that was used longest ago
+        if (mapFiles.size() >= nMaxFiles)
+        {
+            map<unsigned int, CEntry>::iterator itOldest = mapFiles.begin();
+            for (map<unsigned int, CEntry>::iterator mi = mapFiles.begin(); mi != mapFiles.end(); ++mi)
+                if (mi->second.nLastUsed < itOldest->second.nLastUsed)
+                    itOldest = mi;
+            mapFiles.erase(itOldest);
+        }
+        it = mapFiles.insert(make_pair(nFile, CEntry())).first;
+        it->second.nLastUsed = ++nUseCounter;
+    }
+    it->second.mapping = mapping;
+    return mapping;
+}
+
+void CBlockFileMap::Close(unsigned int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+}
+
+void CBlockFileMap::CloseAll()
+{
+    LOCK(cs);
+    mapFiles.clear();
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2016 The altcommunitycoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+
+/** The most block files kept mapped at once */
+static const unsigned int MAX_BLOCK_FILE_MAPS = 32;
+
+/** A read-only mapping of the first nSize bytes of a block file */
+class CBlockFileMapping
+{
+public:
+    const char* pdata;
+    size_t nSize;
+
+    CBlockFileMapping(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CBlockFileMapping();
+
+private:
+    CBlockFileMapping(const CBlockFileMapping&);
+    CBlockFileMapping& operator=(const CBlockFileMapping&);
+};
+
+/** Pool of memory maps over the blk%04u.dat files, so that reading a block or
+ * a transaction does not open, seek and close the file every time.
+ *
+ * Block files only grow, so a mapping covers the file as it was when it was
+ * mapped and is replaced by a larger one when something past its end is
+ * asked for. Mappings are handed out by shared pointer, so a file can be
+ * unmapped from the pool while readers still use the old mapping.
+ */
+class CBlockFileMap
+{
+private:
+    struct CEntry
+    {
+        boost::shared_ptr<CBlockFileMapping> mapping;
+        int64_t nLastUsed;
+    };
+
+    CCriticalSection cs;
+    std::map<unsigned int, CEntry> mapFiles;
+    int64_t nUseCounter;
+    unsigned int nMaxFiles;
+
+public:
+    CBlockFileMap(unsigned int nMaxFilesIn = MAX_BLOCK_FILE_MAPS) : nUseCounter(0), nMaxFiles(nMaxFilesIn) {}
+
+    /** False if block files cannot be mapped on this platform */
+    static bool IsSupported();
+
+    /** Returns a mapping of block file nFile that is at least nMinSize bytes
+     *  long, or NULL if the file is shorter or cannot be mapped */
+    boost::shared_ptr<CBlockFileMapping> Get(unsigned int nFile, size_t nMinSize);
+
+    /** Drops the mapping of nFile, for when the file is changed or removed */
+    void Close(unsigned int nFile);
+    void CloseAll();
+};
+
+extern CBlockFileMap blockFileMap;
+
+#endif
@@ -1,5 +1,41 @@
 #include "hash.h"
 
+void CSkunkHash5Midstate::Init(const void* pheader)
+{
+    sph_skein512_init(&ctx_skein);
+    sph_skein512(&ctx_skein, pheader, PREFIX_SIZE);
+    sph_cubehash512_init(&ctx_cubehash);
+    sph_fugue512_init(&ctx_fugue);
+    sph_gost512_init(&ctx_gost);
+}
+
+uint256 CSkunkHash5Midstate::Hash(unsigned int nNonce) const
+{
+    sph_skein512_context     ctx_skein;
+    sph_cubehash512_context  ctx_cubehash;
+    sph_fugue512_context     ctx_fugue;
+    sph_gost512_context      ctx_gost;
+    uint512 hash[4];
+
+    memcpy(&ctx_skein, &this->ctx_skein, sizeof(ctx_skein));
+    sph_skein512(&ctx_skein, &nNonce, sizeof(nNonce));
+    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[0]));
+
+    memcpy(&ctx_cubehash, &this->ctx_cubehash, sizeof(ctx_cubehash));
+    sph_cubehash512(&ctx_cubehash, static_cast<const void*>(&hash[0]), 64);
+    sph_cubehash512_close(&ctx_cubehash, static_cast<void*>(&hash[1]));
+
+    memcpy(&ctx_fugue, &this->ctx_fugue, sizeof(ctx_fugue));
+    sph_fugue512(&ctx_fugue, static_cast<const void*>(&hash[1]), 64);
+    sph_fugue512_close(&ctx_fugue, static_cast<void*>(&hash[2]));
+
+    memcpy(&ctx_gost, &this->ctx_gost, sizeof(ctx_gost));
+    sph_gost512(&ctx_gost, static_cast<const void*>(&hash[2]), 64);
+    sph_gost512_close(&ctx_gost, static_cast<void*>(&hash[3]));
+
+    return hash[3].trim256();
+}
+
 int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len)
 {
     unsigned char key[128];
@@ -40,3 +76,43 @@ int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx)
     SHA512_Update(&pctx->ctxOuter, buf, 64);
     return SHA512_Final(pmd, &pctx->ctxOuter);
 }
+
+#define SIPROUND do { \
+    v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+    v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+    v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+    v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); \
+} while (0)
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char* p = (const unsigned char*)&val;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t d = 0;
+        for (int j = 7; j >= 0; j--)
+            d = (d << 8) | p[8 * i + j];
+        v3 ^= d;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= d;
+    }
+
+    // Final block: the message length, 32, in the top byte
+    uint64_t d = ((uint64_t)32) << 56;
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -80,6 +80,51 @@ inline uint256 SkunkHash5(const T1 pbegin, const T1 pend)
     return hash[3].trim256();
 }
 
+/** Messages the multi-lane SkunkHash5 kernels hash side by side */
+static const unsigned int SKUNKHASH5_LANES = 8;
+
+/** SkunkHash5 of nCount messages of nLen bytes each, stored back to back at
+ *  pdata. The output is the same as that of SkunkHash5 on every message;
+ *  cubehash, and skein where AVX-512 is available, run on SKUNKHASH5_LANES
+ *  messages at once on the widest vector unit the CPU supports, picked at
+ *  runtime. Fugue and gost stay scalar.
+ */
+void SkunkHash5xN(const void* pdata, size_t nLen, unsigned int nCount, uint256* phashes);
+
+/** Name of the vector kernels SkunkHash5xN uses on this CPU */
+const char* SkunkHash5Kernel();
+
+/** SkunkHash5 of block headers that only differ in their nonce.
+ *
+ *  Skein absorbs its input in 64-byte blocks and holds back the last one
+ *  until more input arrives, so after the 76 header bytes in front of the
+ *  nonce the first block is already compressed. Init() does that once per
+ *  header; Hash() then only runs the final skein block and the other three
+ *  stages, which start from contexts set up in Init() instead of being
+ *  initialized again for every nonce.
+ */
+class CSkunkHash5Midstate
+{
+public:
+    /** Bytes of a serialized header in front of nNonce */
+    static const size_t PREFIX_SIZE = 76;
+
+    /** pheader points to a serialized header; only the prefix is read */
+    void Init(const void* pheader);
+
+    uint256 Hash(unsigned int nNonce) const;
+
+    /** Hashes nCount consecutive nonces starting at nNonce, SKUNKHASH5_LANES
+     *  at a time (see SkunkHash5xN) */
+    void HashBatch(unsigned int nNonce, unsigned int nCount, uint256* phashes) const;
+
+private:
+    sph_skein512_context     ctx_skein;
+    sph_cubehash512_context  ctx_cubehash;
+    sph_fugue512_context     ctx_fugue;
+    sph_gost512_context      ctx_gost;
+};
+
 template<typename T1>
 inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
@@ -91,6 +136,18 @@ inline uint256 Hash(const T1 pbegin, const T1 pend)
     return hash2;
 }
 
+/** Messages the multi-lane double SHA-256 kernels hash side by side */
+static const unsigned int SHA256_LANES = 8;
+
+/** Hash() of nCount messages of nLen bytes each, stored back to back at
+ *  pdata, computed SHA256_LANES messages at once on the widest vector unit
+ *  the CPU supports, picked at runtime.
+ */
+void SHA256DxN(const void* pdata, size_t nLen, unsigned int nCount, uint256* phashes);
+
+/** Name of the kernel SHA256DxN uses on this CPU */
+const char* SHA256DKernel();
+
 class CHashWriter
 {
 private:
@@ -199,4 +256,7 @@ int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
+/** SipHash-2-4 of the 32 bytes of val under the key (k0, k1) */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 #endif
@@ -104,6 +104,9 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        CTxDB::Flush();
+        CTxDB::WriteBlockIndexSnapshot();
+        CloseOrphanBlockFile();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -164,7 +167,19 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: altcommunitycoind.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
+    strUsage += "  -dbwritebuffer=<n>     " + strprintf(_("Set the database write buffer size in megabytes (default: %d)"), DEFAULT_DB_WRITE_BUFFER) + "\n";
+    strUsage += "  -dbmaxopenfiles=<n>    " + strprintf(_("Keep at most <n> database files open (default: %d)"), DEFAULT_DB_MAX_OPEN_FILES) + "\n";
+    strUsage += "  -dbblocksize=<n>       " + strprintf(_("Set the database block size in kilobytes (default: %d)"), DEFAULT_DB_BLOCK_SIZE) + "\n";
+    strUsage += "  -dbcompression         " + _("Compress database blocks (default: 1)") + "\n";
+    strUsage += "  -dbbloombits=<n>       " + strprintf(_("Bits per key of the database bloom filter, 0 = off (default: %d)"), DEFAULT_DB_BLOOM_BITS) + "\n";
+    strUsage += "  -dbsync                " + _("Sync database writes to disk (default: 1)") + "\n";
+    strUsage += "  -dbdefercompaction     " + _("Defer database compactions for a few seconds after new blocks, and compact once when idle after catching up (default: 1)") + "\n";
+    strUsage += "  -dbrecord=<file>       " + _("Record the database reads and writes to <file> for -dbbench") + "\n";
+    strUsage += "  -dbbench[=<file>]      " + _("Time transaction index lookups, replay the database workload recorded in <file> with the -db* options above and exit") + "\n";
+    strUsage += "  -sigcachemib=<n>       " + strprintf(_("Set signature cache size in megabytes, 0 to disable it (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + _("Set signature cache size in entries; ignored if -sigcachemib is given") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification and block pre-validation threads (up to %d, 0 = auto, <0 = leave that many cores free, default: 0)"), MAX_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
@@ -196,6 +211,9 @@ std::string HelpMessage()
 #endif
     strUsage += "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n";
     strUsage += "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this (default: 0.01)") + "\n";
+#ifdef ENABLE_WALLET
+    strUsage += "  -stakethreads=<n>      " + strprintf(_("Set the number of threads searching for stake kernels (up to %d, 0 = all cores, <0 = leave that many cores free, default: 1)"), MAX_STAKE_THREADS) + "\n";
+#endif
     if (fHaveGUI)
         strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
 #if !defined(WIN32)
@@ -241,8 +259,12 @@ std::string HelpMessage()
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -prune=<n>             " + strprintf(_("Remove old block files to keep them under <n> MiB; blocks can then no longer be served to peers or rescanned (default: 0 = off, minimum: %u)"), MIN_PRUNE_TARGET_MB) + "\n";
+    strUsage += "  -indexsnapshot         " + _("Save the block index to a file at shutdown and load it from there at startup (default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocksmib=<n> " + strprintf(_("Keep at most <n> MiB of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocksdiskmib=<n> " + _("Keep at most <n> MiB more of unconnectable blocks in a temporary file (default: as -maxorphanblocksmib)") + "\n";
+    strUsage += "  -headersfirst          " + _("Download headers first, then blocks from several peers at once (default: 1)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -432,6 +454,36 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 #endif
 
+    InitSignatureCache();
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+
+    // -prune=<n> keeps the block files under n MiB
+    int64_t nPruneArg = GetArg("-prune", 0);
+    if (nPruneArg < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    if (nPruneArg > 0)
+    {
+        if ((uint64_t)nPruneArg < MIN_PRUNE_TARGET_MB)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB. Please use a higher number."), MIN_PRUNE_TARGET_MB));
+        if (GetBoolArg("-rescan", false))
+            return InitError(_("Rescans are not possible in pruned mode."));
+        fPruneMode = true;
+        nPruneTarget = (uint64_t)nPruneArg << 20;
+        // Old blocks cannot be served any more
+        nLocalServices &= ~NODE_NETWORK;
+        LogPrintf("Pruning block files to %dMiB\n", nPruneArg);
+    }
+
     fConfChange = GetBoolArg("-confchange", false);
 
 #ifdef ENABLE_WALLET
@@ -469,12 +521,22 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("altcommunitycoin version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using %s kernel for SkunkHash5\n", SkunkHash5Kernel());
+    LogPrintf("Using %s kernel for batched SHA-256\n", SHA256DKernel());
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()));
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string());
     LogPrintf("Used data directory %s\n", strDataDir);
     std::ostringstream strErrors;
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification and block pre-validation\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads; i++)
+            threadGroup.create_thread(&ThreadBlockPreValidation);
+    }
+
     if (fDaemon)
         fprintf(stdout, "altcommunitycoin server starting\n");
 
@@ -622,6 +684,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             return false;
         }
     }
+
+    nStakeThreads = GetArg("-stakethreads", 1);
+    if (nStakeThreads <= 0)
+        nStakeThreads += boost::thread::hardware_concurrency();
+    if (nStakeThreads < 1)
+        nStakeThreads = 1;
+    else if (nStakeThreads > MAX_STAKE_THREADS)
+        nStakeThreads = MAX_STAKE_THREADS;
 #endif
 
     BOOST_FOREACH(string strDest, mapMultiArgs["-seednode"])
@@ -629,6 +699,13 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // ********************************************************* Step 7: load blockchain
 
+    if (mapArgs.count("-dbbench"))
+    {
+        if (!CTxDB::Benchmark(GetArg("-dbbench", "")))
+            return InitError(_("Database benchmark failed"));
+        return false;
+    }
+
     if (GetBoolArg("-loadblockindextest", false))
     {
         CTxDB txdb("r");
@@ -654,6 +731,19 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    {
+        CTxDB txdb("r");
+        bool fPruned = false;
+        txdb.ReadBlockFilesPruned(fPruned);
+        if (fPruned && !fPruneMode)
+            return InitError(_("Block files have been pruned. Restart with -prune to keep using this data directory."));
+    }
+    if (fPruneMode)
+    {
+        LOCK(cs_main);
+        PruneBlockFiles();
+    }
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -664,7 +754,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -764,6 +854,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             else
                 pindexRescan = pindexGenesisBlock;
         }
+        if (fPruneMode && pindexRescan && pindexRescan != pindexBest)
+        {
+            // Every block from the last one the wallet saw on has to be there
+            LOCK(cs_main);
+            for (CBlockIndex* pindex = pindexRescan; pindex; pindex = pindex->pnext)
+                if (IsBlockFilePruned(pindex->nFile))
+                    return InitError(_("The wallet was last synchronised beyond the pruned block files. Start without -prune and resynchronise the block chain."));
+        }
         if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
         {
             uiInterface.InitMessage(_("Rescanning..."));
@@ -787,6 +885,7 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    threadGroup.create_thread(&ThreadScheduleCompaction);
 
     // ********************************************************* Step 10: load peers
 
@@ -835,7 +934,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!GetBoolArg("-staking", true))
         LogPrintf("Staking disabled\n");
     else if (pwalletMain)
+    {
+        if (nStakeThreads > 1)
+        {
+            LogPrintf("Using %d threads for the stake kernel search\n", nStakeThreads);
+            for (int i = 0; i < nStakeThreads - 1; i++)
+                threadGroup.create_thread(&ThreadStakeCheck);
+        }
         threadGroup.create_thread(boost::bind(&ThreadStakeMiner, pwalletMain));
+    }
 #endif
 
     // ********************************************************* Step 12: finished
@@ -258,20 +258,20 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CCoin& coinPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < coinPrev.nTime)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
 
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    int64_t nValueIn = coinPrev.txout.nValue;
 
     uint256 hashBlockFrom = blockFrom.GetHash();
 
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)coinPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
     targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
 
     // Calculate hash
@@ -284,7 +284,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
         return false;
     ss << nStakeModifier;
 
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
+    ss << nTimeBlockFrom << nTxPrevOffset << coinPrev.nTime << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
     if (fPrintProofOfStake)
     {
@@ -295,7 +295,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
             DateTimeStrFormat(blockFrom.GetBlockTime()));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTxPrevOffset, coinPrev.nTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -311,7 +311,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
             DateTimeStrFormat(blockFrom.GetBlockTime()));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTxPrevOffset, coinPrev.nTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
     return true;
@@ -339,17 +339,19 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, const CCoin& coinPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < coinPrev.nTime)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
 
+    unsigned int nTimeBlockFrom = coinPrev.nBlockTime;
+
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    int64_t nValueIn = coinPrev.txout.nValue;
     CBigNum bnWeight = CBigNum(nValueIn);
     bnTarget *= bnWeight;
 
@@ -366,7 +368,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
         ss << bnStakeModifierV2;
     else
         ss << nStakeModifier << nTimeBlockFrom;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << coinPrev.nTime << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -377,7 +379,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, coinPrev.nTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -393,19 +395,24 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, coinPrev.nTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     return true;
 }
 
-bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CCoin& coinPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (IsProtocolV2(pindexPrev->nHeight+1))
-        return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
-    else
-        return CheckStakeKernelHashV1(nBits, blockFrom, nTxPrevOffset, txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+        return CheckStakeKernelHashV2(pindexPrev, nBits, coinPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+
+    // The v1 kernel uses the stake modifier of the block containing txPrev,
+    // which is looked up by its hash, so it still needs the block header
+    CBlock blockFrom;
+    if (!blockFrom.ReadFromDisk(coinPrev.pos.nFile, coinPrev.pos.nBlockPos, false))
+        return fDebug? error("CheckStakeKernelHash() : read block failed") : false;
+    return CheckStakeKernelHashV1(nBits, blockFrom, coinPrev.GetTxOffset(), coinPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
 // Check kernel hash target and coinstake signature
@@ -417,22 +424,16 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
+    // First try finding the previous output in database
     CTxDB txdb("r");
-    CTransaction txPrev;
-    CTxIndex txindex;
-    if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+    CCoin coinPrev;
+    if (!GetCoin(txdb, txin.prevout, coinPrev))
         return tx.DoS(1, error("CheckProofOfStake() : INFO: read txPrev failed"));  // previous transaction not in main chain, may occur during initial download
 
     // Verify signature
-    if (!VerifySignature(txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
+    if (!VerifyScript(txin.scriptSig, coinPrev.txout.scriptPubKey, tx, 0, SCRIPT_VERIFY_NONE, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
-
     // Min age requirement
 
     if (nBestHeight >= 75000 )
@@ -441,17 +442,17 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
    else if (IsProtocolV3(tx.nTime))
     {
         int nDepth;
-        if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
+        if (IsConfirmedInNPrevBlocks(coinPrev.pos, pindexPrev, nStakeMinConfirmations - 1, nDepth))
             return tx.DoS(100, error("CheckProofOfStake() : tried to stake at depth %d", nDepth + 1));
     }
     else
     {
-        unsigned int nTimeBlockFrom = block.GetBlockTime();
+        unsigned int nTimeBlockFrom = coinPrev.nBlockTime;
         if (nTimeBlockFrom + nStakeMinAge > tx.nTime)
             return error("CheckProofOfStake() : min age violation");
     }
 
-    if (!CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(pindexPrev, nBits, coinPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
         return tx.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString(), hashProofOfStake.ToString())); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -471,30 +472,178 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     uint256 hashProofOfStake, targetProofOfStake;
 
     CTxDB txdb("r");
-    CTransaction txPrev;
-    CTxIndex txindex;
-    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
-        return false;
-
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+    CCoin coinPrev;
+    if (!GetCoin(txdb, prevout, coinPrev))
         return false;
 
     if (IsProtocolV3(nTime))
     {
         int nDepth;
-        if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
+        if (IsConfirmedInNPrevBlocks(coinPrev.pos, pindexPrev, nStakeMinConfirmations - 1, nDepth))
             return false;
     }
     else
     {
-        if (block.GetBlockTime() + nStakeMinAge > nTime)
+        if (coinPrev.nBlockTime + nStakeMinAge > nTime)
             return false; // only count coins meeting min age requirement
     }
 
     if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+        *pBlockTime = coinPrev.nBlockTime;
+
+    return CheckStakeKernelHash(pindexPrev, nBits, coinPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+int CStakeKernelCache::Load(CTxDB& txdb, CBlockIndex* pindexPrev, unsigned int nBitsIn, const COutPoint& prevout)
+{
+    LOCK(cs);
+    if (pindexPrev != pindexTip || nBitsIn != nBits)
+    {
+        pindexTip = pindexPrev;
+        nBits = nBitsIn;
+        vInputs.clear();
+        mapIndex.clear();
+    }
+
+    std::map<COutPoint, int>::const_iterator mi = mapIndex.find(prevout);
+    if (mi != mapIndex.end())
+        return mi->second;
+
+    int nIndex = -1;
+    CCoin coinPrev;
+    if (GetCoin(txdb, prevout, coinPrev))
+    {
+        CStakeKernelInput input;
+        input.prevout = prevout;
+        input.nTimeTxPrev = coinPrev.nTime;
+        input.nTimeBlockFrom = coinPrev.nBlockTime;
+        int nDepth;
+        input.fDeepEnough = !IsConfirmedInNPrevBlocks(coinPrev.pos, pindexPrev, nStakeMinConfirmations - 1, nDepth);
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        bnTarget *= CBigNum(coinPrev.txout.nValue);
+        // A target past 256 bits is met by every hash
+        input.hashTarget = bnTarget.bitSize() > 256 ? ~uint256(0) : bnTarget.getuint256();
+        nIndex = vInputs.size();
+        vInputs.push_back(input);
+    }
+    mapIndex[prevout] = nIndex;
+    return nIndex;
+}
+
+bool CStakeKernelCache::IsEligible(const CStakeKernelInput& input, unsigned int nTime) const
+{
+    if (IsProtocolV3(nTime))
+    {
+        if (!input.fDeepEnough)
+            return false;
+    }
+    else
+    {
+        if (input.nTimeBlockFrom + nStakeMinAge > nTime)
+            return false; // only count coins meeting min age requirement
+    }
+    return nTime >= input.nTimeTxPrev; // else transaction timestamp violation
+}
+
+static inline void WriteLE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static inline void WriteLE64(unsigned char* p, uint64_t x)
+{
+    WriteLE32(p, x);
+    WriteLE32(p + 4, x >> 32);
+}
+
+size_t WriteStakeKernel(unsigned char* p, const CBlockIndex* pindexPrev, const CStakeKernelInput& input, unsigned int nTime)
+{
+    unsigned char* pbegin = p;
+    if (IsProtocolV3(nTime))
+    {
+        memcpy(p, &pindexPrev->bnStakeModifierV2, 32); p += 32;
+    }
+    else
+    {
+        WriteLE64(p, pindexPrev->nStakeModifier); p += 8;
+        WriteLE32(p, input.nTimeBlockFrom); p += 4;
+    }
+    WriteLE32(p, input.nTimeTxPrev); p += 4;
+    memcpy(p, &input.prevout.hash, 32); p += 32;
+    WriteLE32(p, input.prevout.n); p += 4;
+    WriteLE32(p, nTime); p += 4;
+    return p - pbegin;
+}
+
+bool CStakeKernelCache::CheckKernel(CBlockIndex* pindexPrev, int nIndex, unsigned int nTime, int64_t* pBlockTime)
+{
+    LOCK(cs);
+    if (pindexPrev != pindexTip || nIndex < 0 || nIndex >= (int)vInputs.size())
+        return false;
+    const CStakeKernelInput& input = vInputs[nIndex];
+
+    if (!IsProtocolV2(pindexPrev->nHeight+1))
+        return ::CheckKernel(pindexPrev, nBits, nTime, input.prevout, pBlockTime);
+
+    if (!IsEligible(input, nTime))
+        return false;
+
+    if (pBlockTime)
+        *pBlockTime = input.nTimeBlockFrom;
+
+    unsigned char pch[STAKE_KERNEL_SIZE_V3];
+    size_t nSize = WriteStakeKernel(pch, pindexTip, input, nTime);
+    return Hash(pch, pch + nSize) <= input.hashTarget;
+}
+
+void CStakeKernelCache::CheckKernels(CBlockIndex* pindexPrev, const std::vector<std::pair<int, unsigned int> >& vCandidates, std::vector<bool>& vfKernel)
+{
+    vfKernel.assign(vCandidates.size(), false);
+
+    // Both kernel sizes can show up in one batch around the switch to v3,
+    // and each batch of SHA256DxN takes messages of one size. The kernels
+    // and targets are copied out under the lock and hashed after it, so
+    // that several staking threads can hash at once.
+    std::vector<unsigned char> vKernels[2];
+    std::vector<unsigned int> vPos[2];
+    std::vector<uint256> vTargets[2];
+    {
+        LOCK(cs);
+        if (pindexPrev != pindexTip)
+            return;
+
+        if (!IsProtocolV2(pindexPrev->nHeight+1))
+        {
+            for (unsigned int i = 0; i < vCandidates.size(); i++)
+                if (vCandidates[i].first >= 0 && vCandidates[i].first < (int)vInputs.size())
+                    vfKernel[i] = ::CheckKernel(pindexPrev, nBits, vCandidates[i].second, vInputs[vCandidates[i].first].prevout);
+            return;
+        }
+
+        for (unsigned int i = 0; i < vCandidates.size(); i++)
+        {
+            int nIndex = vCandidates[i].first;
+            unsigned int nTime = vCandidates[i].second;
+            if (nIndex < 0 || nIndex >= (int)vInputs.size() || !IsEligible(vInputs[nIndex], nTime))
+                continue;
+            int v = IsProtocolV3(nTime) ? 1 : 0;
+            size_t nOffset = vKernels[v].size();
+            vKernels[v].resize(nOffset + (v ? STAKE_KERNEL_SIZE_V3 : STAKE_KERNEL_SIZE_V2));
+            WriteStakeKernel(&vKernels[v][nOffset], pindexTip, vInputs[nIndex], nTime);
+            vPos[v].push_back(i);
+            vTargets[v].push_back(vInputs[nIndex].hashTarget);
+        }
+    }
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    std::vector<uint256> vHashes;
+    for (int v = 0; v < 2; v++)
+    {
+        if (vPos[v].empty())
+            continue;
+        vHashes.resize(vPos[v].size());
+        SHA256DxN(&vKernels[v][0], v ? STAKE_KERNEL_SIZE_V3 : STAKE_KERNEL_SIZE_V2, vPos[v].size(), &vHashes[0]);
+        for (unsigned int j = 0; j < vPos[v].size(); j++)
+            vfKernel[vPos[v][j]] = vHashes[j] <= vTargets[v][j];
+    }
 }
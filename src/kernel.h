@@ -23,7 +23,7 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
-bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CCoin& coinPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
@@ -40,4 +40,62 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+/** The parts of the stake kernel of one output that do not depend on the
+ *  coinstake timestamp, as they are on top of a given tip */
+struct CStakeKernelInput
+{
+    COutPoint prevout;
+    unsigned int nTimeTxPrev;
+    unsigned int nTimeBlockFrom;
+    bool fDeepEnough;           // deep enough for the protocol v3 depth rule
+    uint256 hashTarget;         // nBits target weighted by the output value
+};
+
+/** Size of the serialized kernel before and since protocol v3 */
+static const size_t STAKE_KERNEL_SIZE_V2 = 56;
+static const size_t STAKE_KERNEL_SIZE_V3 = 76;
+
+/** Writes the kernel of input at nTime on top of pindexPrev to p, byte for
+ *  byte as CheckStakeKernelHashV2 serializes it, and returns its size */
+size_t WriteStakeKernel(unsigned char* p, const CBlockIndex* pindexPrev, const CStakeKernelInput& input, unsigned int nTime);
+
+/** Coins whose kernels CreateCoinStake hashes as one batch */
+static const unsigned int STAKE_KERNEL_BATCH_COINS = 64;
+
+/** Kernel inputs of the outputs the staker tries, loaded once per tip, so
+ *  that searching a kernel over many timestamps and coins does not read the
+ *  coins or recompute the stake modifier each time. Entries stay valid
+ *  until the tip or the target changes; outputs that leave the wallet are
+ *  simply no longer asked for. Before protocol v2 the kernel depends on the
+ *  block holding each output, and CheckKernel() is used as it is.
+ */
+class CStakeKernelCache
+{
+private:
+    CCriticalSection cs;
+    CBlockIndex* pindexTip;
+    unsigned int nBits;
+    std::vector<CStakeKernelInput> vInputs;
+    std::map<COutPoint, int> mapIndex;
+
+    bool IsEligible(const CStakeKernelInput& input, unsigned int nTime) const;
+
+public:
+    CStakeKernelCache() : pindexTip(NULL), nBits(0) {}
+
+    /** Index of the entry of prevout on top of pindexPrev, loading it
+     *  first if needed, or -1 if the output cannot stake there */
+    int Load(CTxDB& txdb, CBlockIndex* pindexPrev, unsigned int nBitsIn, const COutPoint& prevout);
+
+    /** Same as CheckKernel() for entry nIndex, without any disk access */
+    bool CheckKernel(CBlockIndex* pindexPrev, int nIndex, unsigned int nTime, int64_t* pBlockTime = NULL);
+
+    /** CheckKernel() of many (entry, timestamp) pairs at once: vfKernel[i]
+     *  is set for the pairs that meet their target. The kernel hashes are
+     *  computed SHA256_LANES at a time with SHA256DxN. */
+    void CheckKernels(CBlockIndex* pindexPrev, const std::vector<std::pair<int, unsigned int> >& vCandidates, std::vector<bool>& vfKernel);
+
+    unsigned int size() { LOCK(cs); return vInputs.size(); }
+};
+
 #endif // PPCOIN_KERNEL_H
@@ -133,6 +133,7 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       seed_(0),
       tmp_batch_(new WriteBatch),
       bg_compaction_scheduled_(false),
+      compaction_deferred_(false),
       manual_compaction_(NULL) {
   mem_->Ref();
   has_imm_.Release_Store(NULL);
@@ -533,6 +534,21 @@ void DBImpl::CompactMemTable() {
   }
 }
 
+bool DBImpl::CompactionHeldBack() {
+  mutex_.AssertHeld();
+  return compaction_deferred_ &&
+         manual_compaction_ == NULL &&
+         versions_->NumLevelFiles(0) < config::kL0_CompactionTrigger;
+}
+
+void DBImpl::SetCompactionDeferred(bool deferred) {
+  MutexLock l(&mutex_);
+  compaction_deferred_ = deferred;
+  if (!deferred) {
+    MaybeScheduleCompaction();
+  }
+}
+
 void DBImpl::CompactRange(const Slice* begin, const Slice* end) {
   int max_level_with_files = 1;
   {
@@ -623,6 +639,8 @@ void DBImpl::MaybeScheduleCompaction() {
              manual_compaction_ == NULL &&
              !versions_->NeedsCompaction()) {
     // No work to be done
+  } else if (imm_ == NULL && CompactionHeldBack()) {
+    // Deferred by the user until SetCompactionDeferred(false)
   } else {
     bg_compaction_scheduled_ = true;
     env_->Schedule(&DBImpl::BGWork, this);
@@ -660,6 +678,11 @@ void DBImpl::BackgroundCompaction() {
     return;
   }
 
+  if (CompactionHeldBack()) {
+    // Size or seek compaction while deferred; picked up again later
+    return;
+  }
+
   Compaction* c;
   bool is_manual = (manual_compaction_ != NULL);
   InternalKey manual_end;
@@ -41,6 +41,7 @@ class DBImpl : public DB {
   virtual bool GetProperty(const Slice& property, std::string* value);
   virtual void GetApproximateSizes(const Range* range, int n, uint64_t* sizes);
   virtual void CompactRange(const Slice* begin, const Slice* end);
+  virtual void SetCompactionDeferred(bool deferred);
 
   // Extra methods (for testing) that are not in the public DB interface
 
@@ -158,6 +159,13 @@ class DBImpl : public DB {
   // Has a background compaction been scheduled or is running?
   bool bg_compaction_scheduled_;
 
+  // Only run the compactions needed to keep writes going?
+  bool compaction_deferred_;
+
+  // True if compactions other than of the memtable are held back by
+  // SetCompactionDeferred() right now
+  bool CompactionHeldBack();
+
   // Information for a manual compaction
   struct ManualCompaction {
     int level;
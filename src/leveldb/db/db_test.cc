@@ -1477,6 +1477,27 @@ TEST(DBTest, ManualCompaction) {
   ASSERT_EQ("0,0,1", FilesPerLevel());
 }
 
+TEST(DBTest, DeferredCompaction) {
+  MakeTables(3, "p", "q");
+  ASSERT_EQ("1,1,1", FilesPerLevel());
+
+  // Level-0 files below the compaction trigger are left alone, as they are
+  // without deferring
+  dbfull()->SetCompactionDeferred(true);
+  MakeTables(config::kL0_CompactionTrigger - 2, "p", "q");
+  DelayMilliseconds(100);
+  ASSERT_EQ(config::kL0_CompactionTrigger - 1, NumTableFilesAtLevel(0));
+
+  // Reaching the trigger compacts level-0 even while deferred, so writes
+  // are never slowed down
+  MakeTables(1, "p", "q");
+  for (int i = 0; i < 100 && NumTableFilesAtLevel(0) > 0; i++) {
+    DelayMilliseconds(10);
+  }
+  ASSERT_EQ(0, NumTableFilesAtLevel(0));
+  dbfull()->SetCompactionDeferred(false);
+}
+
 TEST(DBTest, DBOpen_Options) {
   std::string dbname = test::TmpDir() + "/db_options_test";
   DestroyDB(dbname, Options());
@@ -140,6 +140,14 @@ class DB {
   //    db->CompactRange(NULL, NULL);
   virtual void CompactRange(const Slice* begin, const Slice* end) = 0;
 
+  // While deferred is true, background compactions are only run while
+  // level-0 has fewer files than the compaction trigger: memtable
+  // compactions always run, and once level-0 reaches the trigger
+  // compactions are picked as usual, so writes are never slowed down.
+  // Other compactions wait until this is called again with false.
+  // CompactRange() is not affected.
+  virtual void SetCompactionDeferred(bool deferred) { }
+
  private:
   // No copying allowed
   DB(const DB&);
@@ -6,10 +6,12 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <deque>
 
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -36,7 +38,15 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+
+size_t BlockHasher::operator()(const uint256& hash) const
+{
+    static const uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    static const uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    return SipHashUint256(k0, k1, hash);
+}
+
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 4);
@@ -63,22 +73,38 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
+bool fHeadersFirst = true;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
     uint256 hashPrev;
     std::pair<COutPoint, unsigned int> stake;
     vector<unsigned char> vchBlock;
+    // Where the block was spilled to in the orphan block file, -1 while
+    // vchBlock holds it
+    int64_t nFilePos;
+    unsigned int nSize;
 };
 map<uint256, COrphanBlock*> mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 size_t nOrphanBlocksSize = 0;
 
+// Orphan blocks beyond the -maxorphanblocksmib memory budget are appended to
+// a temporary file and only their index entry is kept in memory, if their
+// header passed the checks that do not need the previous block
+FILE* fileOrphanBlocks = NULL;
+int64_t nOrphanFileEnd = 0;
+size_t nOrphanBlocksSpilledSize = 0;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -152,16 +178,20 @@ void ResendWalletTransactions(bool fForce) {
 // Registration of network node signals.
 //
 
+static void FinalizeNode(CNode* pnode);
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 
@@ -527,7 +557,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -770,7 +800,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -846,7 +876,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -876,7 +906,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
             return true;
         }
         // look for transaction in disconnected blocks to find orphaned CoinBase and CoinStake transactions
-        BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        BOOST_FOREACH(BlockMap::value_type& item, mapBlockIndex)
         {
             CBlockIndex* pindex = item.second;
             if (pindex == pindexBest || pindex->pnext != 0)
@@ -909,22 +939,19 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+void CChain::SetTip(CBlockIndex* pindex)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -965,31 +992,204 @@ uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
     return pblockOrphan->hashPrev;
 }
 
-// Remove a random orphan block (which does not have any dependent orphans).
+static boost::filesystem::path OrphanBlockFilePath()
+{
+    return GetDataDir() / "orphanblocks.tmp";
+}
+
+void CloseOrphanBlockFile()
+{
+    if (fileOrphanBlocks)
+    {
+        fclose(fileOrphanBlocks);
+        fileOrphanBlocks = NULL;
+        boost::filesystem::remove(OrphanBlockFilePath());
+    }
+    nOrphanFileEnd = 0;
+}
+
+static void ForgetSpilledOrphanBlocks();
+
+// Rewrites the orphan block file with only the blocks still spilled to it,
+// in file order, once most of it is taken up by blocks that were connected
+// or dropped
+static bool CompactOrphanBlockFile()
+{
+    if (nOrphanBlocksSpilledSize == 0)
+    {
+        CloseOrphanBlockFile();
+        return true;
+    }
+
+    vector<pair<int64_t, COrphanBlock*> > vSpilled;
+    for (map<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+        if (mi->second->nFilePos >= 0)
+            vSpilled.push_back(make_pair(mi->second->nFilePos, mi->second));
+    sort(vSpilled.begin(), vSpilled.end());
+
+    boost::filesystem::path pathTmp = OrphanBlockFilePath();
+    pathTmp += ".new";
+    FILE* fileNew = fopen(pathTmp.string().c_str(), "w+b");
+    if (!fileNew)
+        return error("CompactOrphanBlockFile() : cannot create %s", pathTmp.string());
+
+    vector<char> vch;
+    vector<int64_t> vPosNew;
+    int64_t nPosNew = 0;
+    for (unsigned int i = 0; i < vSpilled.size(); i++)
+    {
+        COrphanBlock* porphan = vSpilled[i].second;
+        vch.resize(porphan->nSize);
+        if (fseek(fileOrphanBlocks, porphan->nFilePos, SEEK_SET) != 0 ||
+            fread(&vch[0], 1, vch.size(), fileOrphanBlocks) != vch.size() ||
+            fwrite(&vch[0], 1, vch.size(), fileNew) != vch.size())
+        {
+            fclose(fileNew);
+            boost::filesystem::remove(pathTmp);
+            return error("CompactOrphanBlockFile() : I/O error");
+        }
+        vPosNew.push_back(nPosNew);
+        nPosNew += porphan->nSize;
+    }
+
+    // Both files are closed for the rename. If it fails the old file is
+    // kept, and if that cannot be opened again the spilled blocks are lost.
+    fclose(fileNew);
+    fclose(fileOrphanBlocks);
+    fileOrphanBlocks = NULL;
+    bool fRenamed = RenameOver(pathTmp, OrphanBlockFilePath());
+    if (!fRenamed)
+    {
+        LogPrintf("CompactOrphanBlockFile() : cannot rename %s\n", pathTmp.string());
+        boost::filesystem::remove(pathTmp);
+    }
+    fileOrphanBlocks = fopen(OrphanBlockFilePath().string().c_str(), "r+b");
+    if (!fileOrphanBlocks)
+    {
+        ForgetSpilledOrphanBlocks();
+        CloseOrphanBlockFile();
+        return error("CompactOrphanBlockFile() : cannot open %s", OrphanBlockFilePath().string());
+    }
+    if (!fRenamed)
+        return false;
+
+    for (unsigned int i = 0; i < vSpilled.size(); i++)
+        vSpilled[i].second->nFilePos = vPosNew[i];
+    nOrphanFileEnd = nPosNew;
+    LogPrint("orphan", "CompactOrphanBlockFile() : kept %u blocks, %d bytes\n", (unsigned int)vSpilled.size(), nOrphanFileEnd);
+    return true;
+}
+
+// Moves an orphan block out of memory to the end of the orphan block file
+static bool SpillOrphanBlock(COrphanBlock* porphan)
+{
+    if (!fileOrphanBlocks)
+    {
+        // Left over blocks of an earlier run are not indexed, so start over
+        fileOrphanBlocks = fopen(OrphanBlockFilePath().string().c_str(), "w+b");
+        if (!fileOrphanBlocks)
+            return error("SpillOrphanBlock() : cannot create %s", OrphanBlockFilePath().string());
+        nOrphanFileEnd = 0;
+    }
+    if (fseek(fileOrphanBlocks, nOrphanFileEnd, SEEK_SET) != 0 ||
+        fwrite(&porphan->vchBlock[0], 1, porphan->nSize, fileOrphanBlocks) != porphan->nSize)
+        return error("SpillOrphanBlock() : cannot write block %s", porphan->hashBlock.ToString());
+
+    porphan->nFilePos = nOrphanFileEnd;
+    nOrphanFileEnd += porphan->nSize;
+    vector<unsigned char>().swap(porphan->vchBlock);
+    nOrphanBlocksSize -= porphan->nSize;
+    nOrphanBlocksSpilledSize += porphan->nSize;
+    return true;
+}
+
+static bool ReadOrphanBlock(const COrphanBlock* porphan, CBlock& block)
+{
+    try {
+        if (porphan->nFilePos < 0)
+        {
+            CDataStream ss(porphan->vchBlock, SER_DISK, CLIENT_VERSION);
+            ss >> block;
+            return true;
+        }
+
+        if (!fileOrphanBlocks || fseek(fileOrphanBlocks, porphan->nFilePos, SEEK_SET) != 0)
+            return error("ReadOrphanBlock() : cannot seek to block %s", porphan->hashBlock.ToString());
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss.resize(porphan->nSize);
+        if (fread(&ss[0], 1, porphan->nSize, fileOrphanBlocks) != porphan->nSize)
+            return error("ReadOrphanBlock() : cannot read block %s", porphan->hashBlock.ToString());
+        ss >> block;
+    }
+    catch (std::exception &e) {
+        return error("ReadOrphanBlock() : deserialize or I/O error on block %s", porphan->hashBlock.ToString());
+    }
+    return true;
+}
+
+// Drops the bookkeeping of an orphan block that was connected or evicted.
+// The caller removes it from mapOrphanBlocksByPrev.
+static void ForgetOrphanBlock(COrphanBlock* porphan)
+{
+    setStakeSeenOrphan.erase(porphan->stake);
+    mapOrphanBlocks.erase(porphan->hashBlock);
+    if (porphan->nFilePos < 0)
+        nOrphanBlocksSize -= porphan->nSize;
+    else
+        nOrphanBlocksSpilledSize -= porphan->nSize;
+    delete porphan;
+}
+
+// Drops the orphan blocks in the orphan block file, when it is lost
+static void ForgetSpilledOrphanBlocks()
+{
+    std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
+    while (it != mapOrphanBlocksByPrev.end())
+    {
+        if (it->second->nFilePos < 0)
+        {
+            ++it;
+            continue;
+        }
+        ForgetOrphanBlock(it->second);
+        mapOrphanBlocksByPrev.erase(it++);
+    }
+}
+
+// Keeps the orphan blocks within -maxorphanblocksmib in memory and
+// -maxorphanblocksdiskmib on disk by removing random orphans from whichever
+// is over its budget.
 void static PruneOrphanBlocks()
 {
     size_t nMaxOrphanBlocksSize = GetArg("-maxorphanblocksmib", DEFAULT_MAX_ORPHAN_BLOCKS) * ((size_t) 1 << 20);
-    while (nOrphanBlocksSize > nMaxOrphanBlocksSize)
+    size_t nMaxSpilledSize = GetArg("-maxorphanblocksdiskmib", GetArg("-maxorphanblocksmib", DEFAULT_MAX_ORPHAN_BLOCKS)) * ((size_t) 1 << 20);
+
+    if (nOrphanFileEnd > (int64_t)(2 * nOrphanBlocksSpilledSize + ((size_t) 16 << 20)))
+        CompactOrphanBlockFile();
+
+    while (nOrphanBlocksSize > nMaxOrphanBlocksSize || nOrphanBlocksSpilledSize > nMaxSpilledSize)
     {
-        // Pick a random orphan block.
-        int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
-        std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
-        while (pos--) it++;
+        // Pick a random orphan block of the kind to remove. Each is over its
+        // budget, so at least one in some tries is.
+        bool fSpilled = nOrphanBlocksSpilledSize > nMaxSpilledSize;
+        std::multimap<uint256, COrphanBlock*>::iterator it;
+        do {
+            int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
+            it = mapOrphanBlocksByPrev.begin();
+            while (pos--) it++;
+        } while ((it->second->nFilePos >= 0) != fSpilled);
 
-        // As long as this block has other orphans depending on it, move to one of those successors.
+        // As long as this block has other orphans of the same kind depending
+        // on it, move to one of those successors.
         do {
             std::multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
-            if (it2 == mapOrphanBlocksByPrev.end())
+            if (it2 == mapOrphanBlocksByPrev.end() || (it2->second->nFilePos >= 0) != fSpilled)
                 break;
             it = it2;
         } while(1);
 
-        setStakeSeenOrphan.erase(it->second->stake);
-        uint256 hash = it->second->hashBlock;
-        nOrphanBlocksSize -= it->second->vchBlock.size();
-        delete it->second;
+        ForgetOrphanBlock(it->second);
         mapOrphanBlocksByPrev.erase(it);
-        mapOrphanBlocks.erase(hash);
     }
 }
 
@@ -1214,11 +1414,11 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
     nTime = max(GetBlockTime(), GetAdjustedTime());
 }
 
-bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth)
+bool IsConfirmedInNPrevBlocks(const CDiskTxPos& txpos, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth)
 {
     for (const CBlockIndex* pindex = pindexFrom; pindex && pindexFrom->nHeight - pindex->nHeight < nMaxDepth; pindex = pindex->pprev)
     {
-        if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
+        if (pindex->nBlockPos == txpos.nBlockPos && pindex->nFile == txpos.nFile)
         {
             nActualDepth = pindexFrom->nHeight - pindex->nHeight;
             return true;
@@ -1236,14 +1436,20 @@ bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindex
 
 
 
-bool CTransaction::DisconnectInputs(CTxDB& txdb)
+bool CTransaction::DisconnectInputs(CTxDB& txdb, const CCoin* pcoinsSpent)
 {
+    // Remove our own outputs from the coin set
+    uint256 hash = GetHash();
+    for (unsigned int i = 0; i < vout.size(); i++)
+        if (!txdb.EraseCoin(COutPoint(hash, i)))
+            return error("DisconnectInputs() : EraseCoin failed");
+
     // Relinquish previous transactions' spent pointers
     if (!IsCoinBase())
     {
-        BOOST_FOREACH(const CTxIn& txin, vin)
+        for (unsigned int i = 0; i < vin.size(); i++)
         {
-            COutPoint prevout = txin.prevout;
+            COutPoint prevout = vin[i].prevout;
 
             // Get prev txindex from disk
             CTxIndex txindex;
@@ -1259,6 +1465,15 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             // Write back
             if (!txdb.UpdateTxIndex(prevout.hash, txindex))
                 return error("DisconnectInputs() : UpdateTxIndex failed");
+
+            // Return the output to the coin set
+            CCoin coin;
+            if (pcoinsSpent)
+                coin = pcoinsSpent[i];
+            else if (!ReadCoinFromDisk(prevout, txindex, coin))
+                return error("DisconnectInputs() : ReadCoinFromDisk failed");
+            if (!txdb.WriteCoin(prevout, coin))
+                return error("DisconnectInputs() : WriteCoin failed");
         }
     }
 
@@ -1272,8 +1487,93 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
+bool ReadCoinFromDisk(const COutPoint& prevout, const CTxIndex& txindex, CCoin& coin)
+{
+    CTransaction txPrev;
+    if (!txPrev.ReadFromDisk(txindex.pos))
+        return false;
+    if (prevout.n >= txPrev.vout.size())
+        return false;
+
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return false;
+
+    coin = CCoin(txPrev, prevout.n, txindex.pos, (*mi).second->nHeight, block.GetBlockTime());
+    return true;
+}
+
+// Look up the output that prevout refers to. Unspent outputs come straight
+// from the coin set. Outputs that are already spent in the main chain are
+// rebuilt from the block files, which is what reading txPrev used to give.
+bool GetCoin(CTxDB& txdb, const COutPoint& prevout, CCoin& coin)
+{
+    if (txdb.ReadCoin(prevout, coin))
+        return true;
+
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(prevout.hash, txindex))
+        return false;
+    return ReadCoinFromDisk(prevout, txindex, coin);
+}
+
+// Fill txPrev with the parts of the transaction hash that the inputs of tx
+// need: its timestamp, whether it is a coinbase or coinstake, and the outputs
+// being spent. All of it is taken from the coin set. Returns false if one of
+// those outputs is not unspent; the caller then reads txPrev from disk. The
+// result does not hash to the original transaction. The coins found go to
+// the entries of pvCoinsRet, if given, for the inputs that spend them.
+static bool FetchPrevCoins(CTxDB& txdb, const CTransaction& tx, const uint256& hash, const CTxIndex& txindex,
+                           const map<COutPoint, CCoin>* pmapQueuedCoins, CTransaction& txPrev,
+                           vector<CCoin>* pvCoinsRet)
+{
+    txPrev.SetNull();
+    txPrev.vout.resize(txindex.vSpent.size());
+
+    bool fFirst = true;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        if (prevout.hash != hash)
+            continue;
+        if (prevout.n >= txPrev.vout.size())
+            return false;
+
+        CCoin coin;
+        map<COutPoint, CCoin>::const_iterator mi;
+        if (pmapQueuedCoins && (mi = pmapQueuedCoins->find(prevout)) != pmapQueuedCoins->end())
+            coin = (*mi).second;
+        else if (!txdb.ReadCoin(prevout, coin))
+            return false;
+        if (coin.IsNull())
+            return false;
+
+        if (fFirst)
+        {
+            txPrev.nTime = coin.nTime;
+            if (coin.IsCoinBase())
+                txPrev.vin.push_back(CTxIn());
+            else if (coin.IsCoinStake())
+            {
+                txPrev.vin.push_back(CTxIn(COutPoint(0, 0)));
+                txPrev.vout[0].SetEmpty();
+            }
+            fFirst = false;
+        }
+        txPrev.vout[prevout.n] = coin.txout;
+        if (pvCoinsRet)
+            (*pvCoinsRet)[i] = coin;
+    }
+
+    return true;
+}
+
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid,
+                               const map<COutPoint, CCoin>* pmapQueuedCoins, vector<CCoin>* pvCoinsRet)
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1284,6 +1584,9 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     if (IsCoinBase())
         return true; // Coinbase transactions have no inputs to fetch.
 
+    if (pvCoinsRet)
+        pvCoinsRet->assign(vin.size(), CCoin());
+
     for (unsigned int i = 0; i < vin.size(); i++)
     {
         COutPoint prevout = vin[i].prevout;
@@ -1316,7 +1619,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
-        else
+        else if (!FetchPrevCoins(txdb, *this, prevout.hash, txindex, pmapQueuedCoins, txPrev, pvCoinsRet))
         {
             // Get prev tx from disk
             if (!txPrev.ReadFromDisk(txindex.pos))
@@ -1371,7 +1674,7 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1395,7 +1698,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
             {
                 int nSpendDepth;
-                if (IsConfirmedInNPrevBlocks(txindex, pindexBlock, nCoinbaseMaturity, nSpendDepth))
+                if (IsConfirmedInNPrevBlocks(txindex.pos, pindexBlock, nCoinbaseMaturity, nSpendDepth))
                     return error("ConnectInputs() : tried to spend %s at depth %d", txPrev.IsCoinBase() ? "coinbase" : "coinstake", nSpendDepth);
             }
 
@@ -1436,8 +1739,18 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                // Verify signature. txPrev may have been rebuilt from the
+                // coin set, so check against the output script directly
+                // rather than through VerifySignature.
+                const CScript& scriptPubKey = txPrev.vout[prevout.n].scriptPubKey;
+                CScriptCheck check(scriptPubKey, *this, i, flags, 0);
+                if (pvChecks) {
+                    // Queued checks are only run with the block validation
+                    // flags, which never include non-mandatory ones, so a
+                    // failure is always a DoS failure of the whole block.
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                } else if (!check())
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1446,7 +1759,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                         // if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+                        if (VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
                             return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
                     }
                     // Failures of other flags indicate a transaction that is
@@ -1496,12 +1809,51 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
+bool CScriptCheck::operator()() const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString(), nIn);
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("altcommunitycoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // The undo record has the spent coins of all inputs in block order.
+    // Blocks connected before undo records were written do without it.
+    CBlockUndo undo;
+    vector<unsigned int> vSpentOffset(vtx.size(), 0);
+    bool fUndo = txdb.ReadBlockUndo(pindex->GetBlockHash(), undo);
+    if (fUndo)
+    {
+        unsigned int nSpent = 0;
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            vSpentOffset[i] = nSpent;
+            if (!vtx[i].IsCoinBase())
+                nSpent += vtx[i].vin.size();
+        }
+        if (nSpent != undo.vSpent.size())
+        {
+            LogPrintf("DisconnectBlock() : undo record of %s does not match the block\n", pindex->GetBlockHash().ToString());
+            fUndo = false;
+        }
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
+    {
+        const CCoin* pcoinsSpent = (fUndo && !vtx[i].IsCoinBase()) ? &undo.vSpent[vSpentOffset[i]] : NULL;
+        if (!vtx[i].DisconnectInputs(txdb, pcoinsSpent))
             return false;
+    }
+    txdb.EraseBlockUndo(pindex->GetBlockHash());
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1547,6 +1899,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    map<COutPoint, CCoin> mapQueuedCoins;
+    CBlockUndo undo;
+    bool fUndo = true;
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1584,12 +1940,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
 
         MapPrevTx mapInputs;
+        vector<CCoin> vCoinsSpent;
         if (tx.IsCoinBase())
             nValueOut += tx.GetValueOut();
         else
         {
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid, &mapQueuedCoins, &vCoinsSpent))
                 return false;
 
             // Add in sigops done by pay-to-script-hash inputs;
@@ -1608,13 +1965,34 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
+
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            {
+                // Keep the spent coin for the undo record, as FetchInputs
+                // took it from the coin set or the outputs of this block
+                if (!fJustCheck && fUndo)
+                {
+                    if (vCoinsSpent[i].IsNull())
+                        fUndo = false;
+                    else
+                        undo.vSpent.push_back(vCoinsSpent[i]);
+                }
+                mapQueuedCoins[tx.vin[i].prevout].SetNull();
+            }
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            mapQueuedCoins[COutPoint(hashTx, i)] = CCoin(tx, i, posThisTx, pindex->nHeight, GetBlockTime());
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(nFees);
@@ -1653,6 +2031,35 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Write queued coin set changes
+    for (map<COutPoint, CCoin>::iterator mi = mapQueuedCoins.begin(); mi != mapQueuedCoins.end(); ++mi)
+    {
+        if ((*mi).second.IsNull() ? !txdb.EraseCoin((*mi).first) : !txdb.WriteCoin((*mi).first, (*mi).second))
+            return error("ConnectBlock() : updating coin set failed");
+    }
+
+    // Without a complete undo record DisconnectBlock reads the spent coins
+    // from the block files
+    if (fUndo && !txdb.WriteBlockUndo(pindex->GetBlockHash(), undo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
+
+    // Undo records are only kept UNDO_BLOCKS_TO_KEEP blocks deep; drop the
+    // one that has just fallen out of that window
+    if (pindex->nHeight >= UNDO_BLOCKS_TO_KEEP)
+    {
+        const CBlockIndex* pindexExpired = NULL;
+        if (pindex->pprev == chainActive.Tip())
+            pindexExpired = chainActive[pindex->nHeight - UNDO_BLOCKS_TO_KEEP];
+        else
+        {
+            pindexExpired = pindex;
+            for (int i = 0; i < UNDO_BLOCKS_TO_KEEP && pindexExpired; i++)
+                pindexExpired = pindexExpired->pprev;
+        }
+        if (pindexExpired && !txdb.EraseBlockUndo(pindexExpired->GetBlockHash()))
+            return error("ConnectBlock() : EraseBlockUndo failed");
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1872,12 +2279,29 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
+    // Once caught up, write every new best chain through to the database.
+    // During initial download the txdb cache flushes when its budget fills.
+    // Relaying the block and staking on top of it come first, so database
+    // compactions wait a little.
+    if (!IsInitialBlockDownload())
+    {
+        CTxDB::Flush();
+        CTxDB::DeferCompaction(DB_COMPACTION_TIP_DEFER);
+    }
+
+#ifdef ENABLE_WALLET
+    WakeStaker();
+#endif
+
+    if (fPruneMode && nBestHeight % 100 == 0)
+        PruneBlockFiles();
+
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
     LogPrintf("SetBestChain: new best=%s  height=%d  trust=%s  blocktrust=%d  date=%s\n",
@@ -1932,18 +2356,17 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
 
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
-        // First try finding the previous transaction in database
-        CTransaction txPrev;
-        CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        // First try finding the previous output in database
+        CCoin coinPrev;
+        if (!GetCoin(txdb, txin.prevout, coinPrev))
             continue;  // previous transaction not in main chain
-        if (nTime < txPrev.nTime)
+        if (nTime < coinPrev.nTime)
             return false;  // Transaction timestamp violation
 
         if (IsProtocolV3(nTime))
         {
             int nSpendDepth;
-            if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nSpendDepth))
+            if (IsConfirmedInNPrevBlocks(coinPrev.pos, pindexPrev, nStakeMinConfirmations - 1, nSpendDepth))
             {
                 LogPrint("coinage", "coin age skip nSpendDepth=%d\n", nSpendDepth + 1);
                 continue; // only count coins meeting min confirmations requirement
@@ -1951,18 +2374,14 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
         }
         else
         {
-            // Read block header
-            CBlock block;
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                return false; // unable to read block of previous transaction
-            if (block.GetBlockTime() + nStakeMinAge > nTime)
+            if (coinPrev.nBlockTime + nStakeMinAge > nTime)
                 continue; // only count coins meeting min age requirement
         }
 
-        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-        bnCentSecond += CBigNum(nValueIn) * (nTime-txPrev.nTime) / CENT;
+        int64_t nValueIn = coinPrev.txout.nValue;
+        bnCentSecond += CBigNum(nValueIn) * (nTime-coinPrev.nTime) / CENT;
 
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - txPrev.nTime, bnCentSecond.ToString());
+        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - coinPrev.nTime, bnCentSecond.ToString());
     }
 
     CBigNum bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
@@ -1981,11 +2400,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2011,7 +2428,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2137,7 +2554,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2262,83 +2679,608 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
-bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
+//
+// Headers-first synchronization
+//
+// The sync node is asked for headers rather than block inventories. Headers
+// past the block index form a header chain if every header links to the one
+// before it, the headers continue the main chain or a branch that leaves it
+// at or after the last checkpoint, and each header passes the rules that need
+// no block body: version, target, timestamp, checkpoints, and proof of work
+// where the block cannot be proof-of-stake. New headers replace part of the
+// header chain only if they end with more chain trust than it and the main
+// chain. The block bodies are then fetched from the peers that announced
+// them, from a window of BLOCK_DOWNLOAD_WINDOW blocks after the first one we
+// don't have. If that first block keeps failing to arrive, the peer that sent
+// its header is dropped together with the headers from it. Blocks that arrive
+// ahead of their parent wait among the orphans. All of this is protected by
+// cs_main.
+//
+
+struct CBlockInFlight
 {
-    if (pblock->IsProofOfWork()) {
-        return pblock->vchBlockSig.empty();
-    }
+    CNode* pnode;
+    int64_t nTime;
+};
 
-    return checkLowS ? IsLowDERSignature(pblock->vchBlockSig, false) : IsDERSignature(pblock->vchBlockSig, false);
-}
+struct CHeaderChainEntry
+{
+    uint256 hash;
+    unsigned int nTime;
+    unsigned int nBits;
+    uint256 nChainTrust;
+};
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+// Peer that sent the headers from a position of the header chain on. It holds
+// a reference to the node until the node is finalized.
+struct CHeaderSource
 {
-    AssertLockHeld(cs_main);
+    unsigned int nStart;
+    CNode* pnode;
+};
 
-    // Check for duplicate
-    uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+// Headers before the one being checked that the target and timestamp rules
+// look at
+static const unsigned int HEADER_LOOKBACK = 24;
 
-    // ppcoin: check proof-of-stake
-    // Limited duplicity on stake: prevents block flood attack
-    // Duplicate stake allowed only when there is orphan child block
-    if (!fReindex && !fImporting && pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash))
-        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+// Block the header chain continues from, the headers that follow it, and the
+// peers that sent them
+static CBlockIndex* pindexHeadersBase = NULL;
+static vector<CHeaderChainEntry> vHeaderChain;
+static map<uint256, int> mapHeaderChain;
+static vector<CHeaderSource> vHeaderSources;
+// Headers before this position are all in the block index
+static unsigned int nHeaderChainCursor = 0;
 
-    if (pblock->hashPrevBlock != hashBestChain)
+static map<uint256, CBlockInFlight> mapBlocksInFlight;
+
+// Block at the start of the download window, since when it is waited for,
+// and how many times it has failed to arrive
+static uint256 hashWindowHead = 0;
+static int64_t nWindowHeadSince = 0;
+static int nWindowHeadFailures = 0;
+
+static bool IsPreValidating(const uint256& hash);
+
+static int HeaderChainHeight()
+{
+    if (!pindexHeadersBase)
+        return nBestHeight;
+    return pindexHeadersBase->nHeight + vHeaderChain.size();
+}
+
+static uint256 HeaderChainTrust()
+{
+    if (vHeaderChain.empty() || vHeaderChain.back().nChainTrust < nBestChainTrust)
+        return nBestChainTrust;
+    return vHeaderChain.back().nChainTrust;
+}
+
+// Locator of the header chain below position nEnd, then of the block index
+// below it
+static CBlockLocator HeaderChainLocator(unsigned int nEnd)
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    int i = (int)nEnd - 1;
+    while (i >= 0)
     {
-        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-        const CBlockIndex* pcheckpoint = Checkpoints::AutoSelectSyncCheckpoint();
-        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        if (deltaTime < 0)
-        {
-            if (pfrom)
-                pfrom->Misbehaving(1);
-            return error("ProcessBlock() : block with timestamp before last checkpoint");
-        }
+        vHave.push_back(vHeaderChain[i].hash);
+        i -= nStep;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    const CBlockIndex* pindex = pindexHeadersBase ? pindexHeadersBase : pindexBest;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int j = 0; pindex && j < nStep; j++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
     }
+    vHave.push_back(Params().HashGenesisBlock());
+    return CBlockLocator(vHave);
+}
 
-    if (!IsCanonicalBlockSignature(pblock, false)) {
-        if (pfrom && pfrom->nVersion >= CANONICAL_BLOCK_SIG_VERSION) {
-            pfrom->Misbehaving(100);
-        }
+void PushGetHeaders(CNode* pnode)
+{
+    LogPrint("net", "getheaders from height %d to peer %s\n", HeaderChainHeight(), pnode->addr.ToString());
+    pnode->PushMessage("getheaders", HeaderChainLocator(vHeaderChain.size()), uint256(0));
+}
 
-        return error("ProcessBlock(): bad block signature encoding");
-    }
+// Asks pnode for the headers of the download window, so that a peer other
+// than the one that sent them can show it has the blocks
+static void PushGetWindowHeaders(CNode* pnode)
+{
+    unsigned int nWindowEnd = min((unsigned int)vHeaderChain.size(), nHeaderChainCursor + BLOCK_DOWNLOAD_WINDOW);
+    LogPrint("net", "getheaders of the download window to peer %s\n", pnode->addr.ToString());
+    pnode->PushMessage("getheaders", HeaderChainLocator(nHeaderChainCursor), vHeaderChain[nWindowEnd - 1].hash);
+}
 
-    if (!IsCanonicalBlockSignature(pblock, true)) {
-        if (pfrom && pfrom->nVersion >= CANONICAL_BLOCK_SIG_LOW_S_VERSION) {
-            pfrom->Misbehaving(100);
-            return error("ProcessBlock(): bad block signature encoding (low-s)");
-        }
+static void ReleaseHeaderSource(CHeaderSource& source)
+{
+    if (source.pnode)
+        source.pnode->Release();
+    source.pnode = NULL;
+}
 
-        if (!EnsureLowS(pblock->vchBlockSig))
-            return error("ProcessBlock(): EnsureLowS failed");
+// Peer that sent the header at position nPos, if it is still connected
+static CNode* HeaderSource(unsigned int nPos)
+{
+    for (vector<CHeaderSource>::reverse_iterator it = vHeaderSources.rbegin(); it != vHeaderSources.rend(); ++it)
+        if (it->nStart <= nPos)
+            return it->pnode;
+    return NULL;
+}
+
+// Cuts the header chain back to its first nKeep headers
+static void TruncateHeaderChain(unsigned int nKeep)
+{
+    for (unsigned int i = nKeep; i < vHeaderChain.size(); i++)
+        mapHeaderChain.erase(vHeaderChain[i].hash);
+    vHeaderChain.resize(nKeep);
+    nHeaderChainCursor = min(nHeaderChainCursor, nKeep);
+    while (!vHeaderSources.empty() && vHeaderSources.back().nStart >= nKeep)
+    {
+        ReleaseHeaderSource(vHeaderSources.back());
+        vHeaderSources.pop_back();
     }
+}
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
-        return error("ProcessBlock() : CheckBlock FAILED");
+// Notes that pnode has the block of the header chain with this hash, unless
+// it announced a later one before
+static void UpdateBestHeader(CNode* pnode, const uint256& hash)
+{
+    map<uint256, int>::iterator mi = mapHeaderChain.find(hash);
+    if (mi == mapHeaderChain.end())
+        return;
+    map<uint256, int>::iterator miBest = mapHeaderChain.find(pnode->hashBestHeader);
+    if (miBest == mapHeaderChain.end() || miBest->second < mi->second)
+        pnode->hashBestHeader = hash;
+}
 
-    // If we don't already have its previous block, shunt it off to holding area until we get it
-    if (!mapBlockIndex.count(pblock->hashPrevBlock))
-    {
-        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+// Headers may continue a block on the main chain, or on a branch that leaves
+// the main chain at or after the last checkpoint
+static bool CanContinueHeaders(const CBlockIndex* pindex)
+{
+    if (pindex->IsInMainChain())
+        return true;
+    while (pindex && !pindex->IsInMainChain())
+        pindex = pindex->pprev;
+    const CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    return pindex && (!pcheckpoint || pindex->nHeight >= pcheckpoint->nHeight);
+}
 
-        // Accept orphans as long as there is a node to request its parents from
-        if (pfrom) {
-            // ppcoin: check proof-of-stake
-            if (pblock->IsProofOfStake())
-            {
-                // Limited duplicity on stake: prevents block flood attack
-                // Duplicate stake allowed only when there is orphan child block
-                if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash))
-                    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
-            }
-            PruneOrphanBlocks();
+// Index entry standing in for a header, so that the target and timestamp
+// rules can be checked before the block arrives
+static CBlockIndex* AddHeaderIndex(deque<CBlockIndex>& dequeIndex, const uint256& hash, int nHeight, unsigned int nTime, unsigned int nBits, CBlockIndex* pprev)
+{
+    dequeIndex.push_back(CBlockIndex());
+    CBlockIndex* pindex = &dequeIndex.back();
+    pindex->phashBlock = &hash;
+    pindex->pprev = pprev;
+    pindex->nHeight = nHeight;
+    pindex->nTime = nTime;
+    pindex->nBits = nBits;
+    return pindex;
+}
+
+// Checks headers received from pfrom and adds them to the header chain if
+// they bring it more chain trust. Returns false if the peer sent invalid
+// headers.
+static bool AcceptHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    if (vHeaders.empty())
+        return true;
+
+    // Where the headers connect: the header chain, or a block of the index
+    // that headers may continue. The headers of the chain before them stand
+    // in for their blocks.
+    const uint256& hashFirstPrev = vHeaders[0].hashPrevBlock;
+    deque<CBlockIndex> dequeIndex;
+    CBlockIndex* pindexPrev = NULL;
+    bool fInHeaderChain = false;
+    unsigned int nConnect = 0;
+    map<uint256, int>::iterator mi = mapHeaderChain.find(hashFirstPrev);
+    if (mi != mapHeaderChain.end())
+    {
+        fInHeaderChain = true;
+        nConnect = mi->second - pindexHeadersBase->nHeight;
+        unsigned int nFirst = nConnect > HEADER_LOOKBACK ? nConnect - HEADER_LOOKBACK : 0;
+        pindexPrev = (nFirst == 0) ? pindexHeadersBase : NULL;
+        for (unsigned int i = nFirst; i < nConnect; i++)
+        {
+            const CHeaderChainEntry& entry = vHeaderChain[i];
+            pindexPrev = AddHeaderIndex(dequeIndex, entry.hash, pindexHeadersBase->nHeight + 1 + i, entry.nTime, entry.nBits, pindexPrev);
+            pindexPrev->nChainTrust = entry.nChainTrust;
+        }
+    }
+    else
+    {
+        BlockMap::iterator miIndex = mapBlockIndex.find(hashFirstPrev);
+        if (miIndex == mapBlockIndex.end())
+            return error("AcceptHeaders() : headers from %s do not connect", pfrom->addr.ToString());
+        pindexPrev = miIndex->second;
+        if (!CanContinueHeaders(pindexPrev))
+            return error("AcceptHeaders() : headers from %s branch off before the last checkpoint", pfrom->addr.ToString());
+    }
+    CBlockIndex* pindexConnect = pindexPrev;
+    int nPrevHeight = pindexPrev->nHeight;
+
+    // The hash of old headers and the proof of work of headers that cannot be
+    // proof-of-stake are both SkunkHash5, computed in one batch
+    vector<unsigned char> vData;
+    vector<unsigned int> vSkunk;
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        const CBlock& header = vHeaders[i];
+        int nHeight = nPrevHeight + 1 + i;
+        if (header.nVersion <= 6 || nHeight < Params().POS_START() ||
+            !CheckCoinStakeTimestamp(nHeight, header.GetBlockTime(), header.GetBlockTime()))
+        {
+            vData.insert(vData.end(), BEGIN(header.nVersion), END(header.nNonce));
+            vSkunk.push_back(i);
+        }
+    }
+    vector<uint256> vPoWHash(vSkunk.size());
+    if (!vSkunk.empty())
+        SkunkHash5xN(&vData[0], 80, vSkunk.size(), &vPoWHash[0]);
+
+    vector<uint256> vHash(vHeaders.size());
+    unsigned int nSkunk = 0;
+    int64_t nMaxTime = FutureDriftV2(GetAdjustedTime());
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        const CBlock& header = vHeaders[i];
+        int nHeight = nPrevHeight + 1 + i;
+        bool fSkunk = (nSkunk < vSkunk.size() && vSkunk[nSkunk] == i);
+        uint256 hashPoW = fSkunk ? vPoWHash[nSkunk++] : 0;
+
+        vHash[i] = (header.nVersion > 6) ? header.GetHash() : hashPoW;
+        if (i > 0 && header.hashPrevBlock != vHash[i - 1])
+        {
+            pfrom->Misbehaving(20);
+            return error("AcceptHeaders() : non-continuous headers from %s", pfrom->addr.ToString());
+        }
+        if (IsProtocolV2(nHeight) != (header.nVersion > 6))
+        {
+            pfrom->Misbehaving(100);
+            return error("AcceptHeaders() : header %s has version %d at height %d", vHash[i].ToString(), header.nVersion, nHeight);
+        }
+
+        // Below the proof-of-stake start, and where the timestamp breaks the
+        // coinstake rule, the block can only be proof-of-work
+        bool fProofOfWork = nHeight < Params().POS_START() ||
+            !CheckCoinStakeTimestamp(nHeight, header.GetBlockTime(), header.GetBlockTime());
+        if (fProofOfWork && nHeight > Params().LastPOWBlock())
+        {
+            pfrom->Misbehaving(50);
+            return error("AcceptHeaders() : coinstake timestamp violation in header %s", vHash[i].ToString());
+        }
+        if (fProofOfWork && !CheckProofOfWork(hashPoW, header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("AcceptHeaders() : proof of work failed for header %s", vHash[i].ToString());
+        }
+        // Otherwise either target will do. They only differ outside the
+        // DarkGravityWave heights.
+        if (header.nBits != GetNextTargetRequired(pindexPrev, !fProofOfWork) &&
+            (fProofOfWork || header.nBits != GetNextTargetRequired(pindexPrev, false)))
+        {
+            pfrom->Misbehaving(100);
+            return error("AcceptHeaders() : incorrect target in header %s", vHash[i].ToString());
+        }
+
+        if (header.GetBlockTime() <= pindexPrev->GetPastTimeLimit() || FutureDrift(header.GetBlockTime(), nHeight) < pindexPrev->GetBlockTime())
+            return error("AcceptHeaders() : header %s timestamp is too early", vHash[i].ToString());
+        if (header.GetBlockTime() > nMaxTime)
+            return error("AcceptHeaders() : header %s timestamp too far in the future", vHash[i].ToString());
+        if (!Checkpoints::CheckHardened(nHeight, vHash[i]))
+        {
+            pfrom->Misbehaving(100);
+            return error("AcceptHeaders() : rejected by checkpoint at height %d", nHeight);
+        }
+
+        pindexPrev = AddHeaderIndex(dequeIndex, vHash[i], nHeight, header.nTime, header.nBits, pindexPrev);
+        pindexPrev->nChainTrust = pindexPrev->pprev->nChainTrust + pindexPrev->GetBlockTrust();
+    }
+
+    if (mapHeaderChain.count(vHash.back()) || pindexPrev->nChainTrust <= HeaderChainTrust())
+    {
+        UpdateBestHeader(pfrom, vHash.back());
+        return true;
+    }
+
+    // Cut the header chain back to where the new headers connect, or start
+    // it again from the block index
+    if (fInHeaderChain)
+        TruncateHeaderChain(nConnect);
+    else
+    {
+        TruncateHeaderChain(0);
+        pindexHeadersBase = pindexConnect;
+    }
+    if (vHeaderSources.empty() || vHeaderSources.back().pnode != pfrom)
+    {
+        CHeaderSource source;
+        source.nStart = vHeaderChain.size();
+        source.pnode = pfrom->AddRef();
+        vHeaderSources.push_back(source);
+    }
+    unsigned int nFirstNew = dequeIndex.size() - vHeaders.size();
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        CHeaderChainEntry entry;
+        entry.hash = vHash[i];
+        entry.nTime = vHeaders[i].nTime;
+        entry.nBits = vHeaders[i].nBits;
+        entry.nChainTrust = dequeIndex[nFirstNew + i].nChainTrust;
+        vHeaderChain.push_back(entry);
+        mapHeaderChain[vHash[i]] = nPrevHeight + 1 + i;
+    }
+    UpdateBestHeader(pfrom, vHash.back());
+
+    LogPrint("net", "accepted %u headers from %s, header chain height %d\n", vHeaders.size(), pfrom->addr.ToString(), HeaderChainHeight());
+    return true;
+}
+
+// Called when a block arrives, requested or not
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    it->second.pnode->nBlocksInFlight--;
+    it->second.pnode->Release();
+    mapBlocksInFlight.erase(it);
+}
+
+// Releases the blocks in flight from a disconnected node, so that they can be
+// asked from other peers, and the headers it sent, so that the node can be
+// deleted. The socket thread calls this until the node is gone, so it does
+// not wait for cs_main.
+static void FinalizeNode(CNode* pnode)
+{
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain)
+        return;
+    BOOST_FOREACH(CHeaderSource& source, vHeaderSources)
+        if (source.pnode == pnode)
+            ReleaseHeaderSource(source);
+    if (pnode->nBlocksInFlight == 0)
+        return;
+    for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+    {
+        if (it->second.pnode == pnode)
+        {
+            pnode->nBlocksInFlight--;
+            pnode->Release();
+            mapBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+}
+
+// Moves the cursor past headers whose blocks are in the block index, and
+// drops the part of the header chain that is on the main chain
+static void AdvanceHeaderChain()
+{
+    while (nHeaderChainCursor < vHeaderChain.size() && mapBlockIndex.count(vHeaderChain[nHeaderChainCursor].hash))
+        nHeaderChainCursor++;
+
+    if (nHeaderChainCursor < vHeaderChain.size() && vHeaderChain[nHeaderChainCursor].hash != hashWindowHead)
+    {
+        hashWindowHead = vHeaderChain[nHeaderChainCursor].hash;
+        nWindowHeadSince = GetTime();
+        nWindowHeadFailures = 0;
+    }
+
+    if (nHeaderChainCursor >= BLOCK_DOWNLOAD_WINDOW)
+    {
+        CBlockIndex* pindexNewBase = mapBlockIndex[vHeaderChain[nHeaderChainCursor - 1].hash];
+        if (!pindexNewBase->IsInMainChain())
+            return;
+        for (unsigned int i = 0; i < nHeaderChainCursor; i++)
+            mapHeaderChain.erase(vHeaderChain[i].hash);
+        vHeaderChain.erase(vHeaderChain.begin(), vHeaderChain.begin() + nHeaderChainCursor);
+
+        // Keep the sources of the headers that are left
+        unsigned int nFirst = 0;
+        while (nFirst + 1 < vHeaderSources.size() && vHeaderSources[nFirst + 1].nStart <= nHeaderChainCursor)
+            nFirst++;
+        for (unsigned int i = 0; i < nFirst; i++)
+            ReleaseHeaderSource(vHeaderSources[i]);
+        vHeaderSources.erase(vHeaderSources.begin(), vHeaderSources.begin() + nFirst);
+        BOOST_FOREACH(CHeaderSource& source, vHeaderSources)
+            source.nStart = (source.nStart > nHeaderChainCursor) ? source.nStart - nHeaderChainCursor : 0;
+
+        pindexHeadersBase = pindexNewBase;
+        nHeaderChainCursor = 0;
+    }
+}
+
+// Picks blocks in the download window for pto to send. A block that does not
+// arrive is asked again; the peer that sent its header is dropped if it
+// keeps failing.
+static void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    int64_t nNow = GetTime();
+
+    // Forget requests to peers that are gone or too slow
+    for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+    {
+        CNode* pnode = it->second.pnode;
+        if (pnode->fDisconnect || nNow - it->second.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            if (!pnode->fDisconnect)
+                LogPrint("net", "Timeout downloading block %s from peer %s\n", it->first.ToString(), pnode->addr.ToString());
+            pnode->nBlocksInFlight--;
+            pnode->Release();
+            mapBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+
+    AdvanceHeaderChain();
+    if (nHeaderChainCursor >= vHeaderChain.size())
+        return;
+
+    // The block at the start of the window is overdue, whoever it was asked
+    // from. Blocks that never come mean the headers were made up.
+    if (nNow - nWindowHeadSince > BLOCK_DOWNLOAD_TIMEOUT && !IsPreValidating(hashWindowHead))
+    {
+        nWindowHeadSince = nNow;
+        if (++nWindowHeadFailures >= MAX_BLOCK_REQUEST_FAILURES)
+        {
+            CNode* pnodeSource = HeaderSource(nHeaderChainCursor);
+            if (pnodeSource)
+            {
+                LogPrintf("Peer %s sent the header of block %s, which does not arrive, disconnecting\n", pnodeSource->addr.ToString(), hashWindowHead.ToString());
+                pnodeSource->fDisconnect = true;
+            }
+            else
+                LogPrintf("Block %s does not arrive, dropping the header chain from it\n", hashWindowHead.ToString());
+            TruncateHeaderChain(nHeaderChainCursor);
+            if (!pto->fDisconnect)
+                PushGetHeaders(pto);
+            return;
+        }
+    }
+
+    // Blocks are only asked from peers that announced their headers
+    int nWindowHeight = pindexHeadersBase->nHeight + 1 + nHeaderChainCursor;
+    map<uint256, int>::iterator mi = mapHeaderChain.find(pto->hashBestHeader);
+    int nPeerHeight = (mi != mapHeaderChain.end()) ? mi->second : -1;
+    if (nPeerHeight < nWindowHeight)
+    {
+        if (pto->nStartingHeight >= nWindowHeight && nNow - pto->nLastGetWindowHeaders > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            pto->nLastGetWindowHeaders = nNow;
+            PushGetWindowHeaders(pto);
+        }
+        return;
+    }
+    if (pto->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+        return;
+
+    unsigned int nWindowEnd = min((unsigned int)vHeaderChain.size(), nHeaderChainCursor + BLOCK_DOWNLOAD_WINDOW);
+    unsigned int i;
+    for (i = nHeaderChainCursor; i < nWindowEnd; i++)
+    {
+        const uint256& hash = vHeaderChain[i].hash;
+        if (pindexHeadersBase->nHeight + 1 + (int)i > nPeerHeight)
+            return;
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash) || IsPreValidating(hash))
+            continue;
+
+        CBlockInFlight inflight;
+        inflight.pnode = pto->AddRef();
+        inflight.nTime = nNow;
+        mapBlocksInFlight[hash] = inflight;
+        pto->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        if (pto->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            return;
+    }
+
+    // pto could take more, but everything in the window is taken. If the
+    // block the window waits on has been at its start and in flight for too
+    // long, it is taken back from the peer it was asked from.
+    if (i == nHeaderChainCursor + BLOCK_DOWNLOAD_WINDOW)
+    {
+        map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(vHeaderChain[nHeaderChainCursor].hash);
+        if (it != mapBlocksInFlight.end() && it->second.pnode != pto &&
+            nNow - max(nWindowHeadSince, it->second.nTime) > BLOCK_STALLING_TIMEOUT)
+        {
+            LogPrint("net", "Peer %s is stalling block download\n", it->second.pnode->addr.ToString());
+            it->second.pnode->nBlocksInFlight--;
+            it->second.pnode->Release();
+            mapBlocksInFlight.erase(it);
+        }
+    }
+}
+
+bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
+{
+    if (pblock->IsProofOfWork()) {
+        return pblock->vchBlockSig.empty();
+    }
+
+    return checkLowS ? IsLowDERSignature(pblock->vchBlockSig, false) : IsDERSignature(pblock->vchBlockSig, false);
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked)
+{
+    AssertLockHeld(cs_main);
+
+    // Check for duplicate
+    uint256 hash = pblock->GetHash();
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+
+    // ppcoin: check proof-of-stake
+    // Limited duplicity on stake: prevents block flood attack
+    // Duplicate stake allowed only when there is orphan child block
+    if (!fReindex && !fImporting && pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash))
+        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+
+    if (pblock->hashPrevBlock != hashBestChain)
+    {
+        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        const CBlockIndex* pcheckpoint = Checkpoints::AutoSelectSyncCheckpoint();
+        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
+        if (deltaTime < 0)
+        {
+            if (pfrom)
+                pfrom->Misbehaving(1);
+            return error("ProcessBlock() : block with timestamp before last checkpoint");
+        }
+    }
+
+    if (!IsCanonicalBlockSignature(pblock, false)) {
+        if (pfrom && pfrom->nVersion >= CANONICAL_BLOCK_SIG_VERSION) {
+            pfrom->Misbehaving(100);
+        }
+
+        return error("ProcessBlock(): bad block signature encoding");
+    }
+
+    if (!IsCanonicalBlockSignature(pblock, true)) {
+        if (pfrom && pfrom->nVersion >= CANONICAL_BLOCK_SIG_LOW_S_VERSION) {
+            pfrom->Misbehaving(100);
+            return error("ProcessBlock(): bad block signature encoding (low-s)");
+        }
+
+        if (!EnsureLowS(pblock->vchBlockSig))
+            return error("ProcessBlock(): EnsureLowS failed");
+    }
+
+    // Preliminary checks, unless they were run before taking cs_main
+    if (!fChecked && !pblock->CheckBlock())
+        return error("ProcessBlock() : CheckBlock FAILED");
+
+    // If we don't already have its previous block, shunt it off to holding area until we get it
+    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    {
+        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+
+        // Accept orphans as long as there is a node to request its parents
+        // from, or the parents may still follow in the files being imported
+        if (pfrom || fImporting) {
+            // ppcoin: check proof-of-stake
+            if (pblock->IsProofOfStake())
+            {
+                // Limited duplicity on stake: prevents block flood attack
+                // Duplicate stake allowed only when there is orphan child block
+                if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash))
+                    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+            }
+            PruneOrphanBlocks();
             COrphanBlock* pblock2 = new COrphanBlock();
             {
                 CDataStream ss(SER_DISK, CLIENT_VERSION);
@@ -2348,18 +3290,42 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             pblock2->hashBlock = hash;
             pblock2->hashPrev = pblock->hashPrevBlock;
             pblock2->stake = pblock->GetProofOfStake();
-            nOrphanBlocksSize += pblock2->vchBlock.size();
+            pblock2->nFilePos = -1;
+            pblock2->nSize = pblock2->vchBlock.size();
+            nOrphanBlocksSize += pblock2->nSize;
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            // Past the memory budget, new orphans go to the orphan block file
+            // if their header was checked: CheckBlock verified the proof of
+            // work of a proof-of-work block, and AcceptHeaders the header of
+            // a block in the header chain. The others, and any that fail to
+            // be written, stay in memory for PruneOrphanBlocks to bound.
+            if (nOrphanBlocksSize > GetArg("-maxorphanblocksmib", DEFAULT_MAX_ORPHAN_BLOCKS) * ((size_t) 1 << 20) &&
+                (pblock->IsProofOfWork() || mapHeaderChain.count(hash)))
+                SpillOrphanBlock(pblock2);
+
+            if (!pfrom)
+                return true;
+
+            // Ask this guy to fill in what we're missing, unless the block
+            // came through the headers-first download window, which fetches
+            // the parents itself
+            if (fHeadersFirst)
+            {
+                if (!mapHeaderChain.count(hash))
+                    PushGetHeaders(pfrom);
+            }
+            else
+            {
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            }
         }
         return true;
     }
@@ -2368,37 +3334,242 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->AcceptBlock())
         return error("ProcessBlock() : AcceptBlock FAILED");
 
-    // Recursively process any orphan blocks that depended on this one
+    // Recursively process any orphan blocks that depended on this one. The
+    // children of each block are read in file order, so a chain of spilled
+    // orphans is read back mostly sequentially.
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
+    unsigned int nConnected = 0;
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
+        vector<pair<int64_t, COrphanBlock*> > vChildren;
         for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vChildren.push_back(make_pair(mi->second->nFilePos, mi->second));
+        mapOrphanBlocksByPrev.erase(hashPrev);
+        sort(vChildren.begin(), vChildren.end());
+
+        for (unsigned int j = 0; j < vChildren.size(); j++)
         {
+            COrphanBlock* porphan = vChildren[j].second;
             CBlock block;
+            if (ReadOrphanBlock(porphan, block))
             {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
+                block.BuildMerkleTree();
+                if (block.AcceptBlock())
+                {
+                    vWorkQueue.push_back(porphan->hashBlock);
+                    nConnected++;
+                }
             }
-            block.BuildMerkleTree();
-            if (block.AcceptBlock())
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            setStakeSeenOrphan.erase(block.GetProofOfStake());
-            nOrphanBlocksSize -= mi->second->vchBlock.size();
-            delete mi->second;
+            ForgetOrphanBlock(porphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
+    if (nConnected > 0)
+        LogPrint("orphan", "ProcessBlock: connected %u orphans, %u left (%u KiB in memory, %u KiB on disk)\n",
+            nConnected, (unsigned int)mapOrphanBlocks.size(), (unsigned int)(nOrphanBlocksSize >> 10), (unsigned int)(nOrphanBlocksSpilledSize >> 10));
+    if (mapOrphanBlocks.empty())
+        CloseOrphanBlockFile();
 
     LogPrintf("ProcessBlock: ACCEPTED\n");
 
     return true;
 }
 
+// Hands a block whose context-free checks have been run to ProcessBlock
+static void ProcessCheckedBlock(CNode* pfrom, CBlock& block, bool fChecked)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+
+    LOCK(cs_main);
+
+    if (fChecked && ProcessBlock(pfrom, &block, true))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
+/** Runs CheckBlock on blocks received during initial download on worker
+ *  threads, so that hashing the header, the transactions and the merkle tree
+ *  is done outside cs_main and for several blocks at once. Only the checks
+ *  that depend on the chain are left to ProcessBlock under cs_main. Checked
+ *  blocks are handed on in the order they were received, because peers send
+ *  them parent first and reordering them would turn them into orphans.
+ */
+class CBlockPreValidator
+{
+private:
+    struct CJob
+    {
+        CNode* pfrom;
+        CBlock block;
+        uint256 hash;
+        bool fDone;
+        bool fChecked;
+    };
+
+    boost::mutex mutex;
+
+    // Workers wait on this for jobs to check
+    boost::condition_variable condWorker;
+
+    // All pending jobs in the order they were received
+    std::deque<CJob*> queuePending;
+
+    // Jobs not picked up by a worker yet
+    std::deque<CJob*> queueTodo;
+
+    // Held by the thread handing checked blocks to ProcessBlock
+    boost::mutex mutexSubmit;
+
+    // Upper bound on the blocks held in memory
+    unsigned int nMaxPending;
+
+    // Hands the checked blocks at the front of the queue to ProcessBlock.
+    // Whoever finds the front done does the work; the others go back to
+    // checking blocks.
+    void Submit()
+    {
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (queuePending.empty() || !queuePending.front()->fDone)
+                    return;
+            }
+            if (!mutexSubmit.try_lock())
+                return;
+            while (true)
+            {
+                CJob* job;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    if (queuePending.empty() || !queuePending.front()->fDone)
+                        break;
+                    job = queuePending.front();
+                }
+                ProcessCheckedBlock(job->pfrom, job->block, job->fChecked);
+                job->pfrom->Release();
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    queuePending.pop_front();
+                }
+                delete job;
+            }
+            mutexSubmit.unlock();
+            // A worker may have finished the front while we were leaving
+        }
+    }
+
+public:
+    CBlockPreValidator(unsigned int nMaxPendingIn) : nMaxPending(nMaxPendingIn) {}
+
+    // Worker thread. Jobs are taken SKUNKHASH5_LANES at a time so that the
+    // proof-of-work hashes of a batch go through SkunkHash5xN together.
+    void Thread()
+    {
+        std::vector<CJob*> vJobs;
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueTodo.empty())
+                    condWorker.wait(lock);
+                vJobs.clear();
+                while (!queueTodo.empty() && vJobs.size() < SKUNKHASH5_LANES)
+                {
+                    vJobs.push_back(queueTodo.front());
+                    queueTodo.pop_front();
+                }
+            }
+
+            // Up to version 6 the block hash is the proof-of-work hash, and
+            // it was computed when the block was received
+            std::vector<unsigned char> vData;
+            std::vector<unsigned int> vSkunk;
+            for (unsigned int i = 0; i < vJobs.size(); i++)
+            {
+                const CBlock& block = vJobs[i]->block;
+                if (block.IsProofOfWork() && block.nVersion > 6)
+                {
+                    vData.insert(vData.end(), BEGIN(block.nVersion), END(block.nNonce));
+                    vSkunk.push_back(i);
+                }
+            }
+            std::vector<uint256> vPoWHash(vSkunk.size());
+            if (!vSkunk.empty())
+                SkunkHash5xN(&vData[0], 80, vSkunk.size(), &vPoWHash[0]);
+
+            unsigned int nSkunk = 0;
+            for (unsigned int i = 0; i < vJobs.size(); i++)
+            {
+                CJob* job = vJobs[i];
+                bool fChecked;
+                if (job->block.IsProofOfWork())
+                {
+                    uint256 hashPoW = job->block.nVersion > 6 ? vPoWHash[nSkunk++] : job->hash;
+                    if (CheckProofOfWork(hashPoW, job->block.nBits))
+                        fChecked = job->block.CheckBlock(false);
+                    else
+                        fChecked = job->block.DoS(50, error("CheckBlock() : proof of work failed"));
+                }
+                else
+                    fChecked = job->block.CheckBlock();
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    job->fChecked = fChecked;
+                    job->fDone = true;
+                }
+                Submit();
+            }
+        }
+    }
+
+    // Queues a block for checking. Returns false without waiting when too
+    // many blocks are pending, so the message handler never blocks here.
+    bool Add(CNode* pfrom, const CBlock& block, const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queuePending.size() >= nMaxPending)
+            return false;
+
+        CJob* job = new CJob;
+        job->pfrom = pfrom->AddRef();
+        job->block = block;
+        job->hash = hash;
+        job->fDone = false;
+        job->fChecked = false;
+        queuePending.push_back(job);
+        queueTodo.push_back(job);
+        condWorker.notify_one();
+        return true;
+    }
+
+    // Whether a block is waiting to be checked or handed on
+    bool IsPending(const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(const CJob* job, queuePending)
+            if (job->hash == hash)
+                return true;
+        return false;
+    }
+};
+
+static CBlockPreValidator blockprevalidator(MAX_PREVALIDATION_BLOCKS);
+
+void ThreadBlockPreValidation()
+{
+    RenameThread("altcommunitycoin-blockch");
+    blockprevalidator.Thread();
+}
+
+static bool IsPreValidating(const uint256& hash)
+{
+    return nScriptCheckThreads && blockprevalidator.IsPending(hash);
+}
+
 #ifdef ENABLE_WALLET
 // novacoin: attempt to generate suitable proof-of-stake
 bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
@@ -2515,7 +3686,7 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
+filesystem::path BlockFilePath(unsigned int nFile)
 {
     string strBlockFn = strprintf("blk%04u.dat", nFile);
     return GetDataDir() / strBlockFn;
@@ -2552,7 +3723,8 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
         if (fseek(file, 0, SEEK_END) != 0)
             return NULL;
         // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        long nMaxFileSize = fPruneMode ? (long)PRUNE_BLOCKFILE_SIZE : (long)(0x7F000000 - MAX_SIZE);
+        if (ftell(file) < nMaxFileSize)
         {
             nFileRet = nCurrentBlockFile;
             return file;
@@ -2562,6 +3734,126 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+//
+// Pruning
+//
+// A block file can go once every block in it is MIN_BLOCKS_TO_KEEP deep.
+// Unspent outputs of those blocks stay in the coin set, along with what the
+// stake kernel needs of them (block time, transaction time and offset), and
+// recent blocks are still there to disconnect and to serve to peers.
+//
+
+static set<unsigned int> setPrunedBlockFiles;
+
+bool IsBlockFilePruned(unsigned int nFile)
+{
+    AssertLockHeld(cs_main);
+    return setPrunedBlockFiles.count(nFile) > 0;
+}
+
+void PruneBlockFiles()
+{
+    AssertLockHeld(cs_main);
+    if (!fPruneMode || pindexBest == NULL)
+        return;
+
+    // The highest block of every file
+    map<unsigned int, int> mapFileMaxHeight;
+    BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+    {
+        map<unsigned int, int>::iterator mi = mapFileMaxHeight.insert(make_pair(item.second->nFile, 0)).first;
+        mi->second = max(mi->second, item.second->nHeight);
+    }
+
+    map<unsigned int, uint64_t> mapFileSize;
+    uint64_t nTotalSize = 0;
+    for (map<unsigned int, int>::iterator mi = mapFileMaxHeight.begin(); mi != mapFileMaxHeight.end(); ++mi)
+    {
+        if (setPrunedBlockFiles.count(mi->first))
+            continue;
+        boost::system::error_code ec;
+        uint64_t nSize = filesystem::file_size(BlockFilePath(mi->first), ec);
+        if (ec)
+        {
+            // Removed by an earlier run
+            setPrunedBlockFiles.insert(mi->first);
+            continue;
+        }
+        mapFileSize[mi->first] = nSize;
+        nTotalSize += nSize;
+    }
+
+    // Oldest files first; the file being appended to always stays
+    set<unsigned int> setPrune;
+    uint64_t nPrunedSize = 0;
+    for (map<unsigned int, uint64_t>::iterator mi = mapFileSize.begin(); mi != mapFileSize.end(); ++mi)
+    {
+        if (nTotalSize - nPrunedSize <= nPruneTarget)
+            break;
+        if (mi->first == mapFileSize.rbegin()->first || mapFileMaxHeight[mi->first] + MIN_BLOCKS_TO_KEEP > nBestHeight)
+            break;
+        setPrune.insert(mi->first);
+        nPrunedSize += mi->second;
+    }
+    if (setPrune.empty())
+        return;
+
+    // The coin set must be on disk before the blocks it was built from go,
+    // and the undo records of those blocks are of no use any more
+    CTxDB txdb;
+    txdb.TxnBegin();
+    BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+        if (setPrune.count(item.second->nFile))
+            txdb.EraseBlockUndo(item.first);
+    txdb.WriteBlockFilesPruned(true);
+    if (!txdb.TxnCommit() || !CTxDB::Flush())
+    {
+        LogPrintf("PruneBlockFiles() : database write failed\n");
+        return;
+    }
+
+    BOOST_FOREACH(unsigned int nFile, setPrune)
+    {
+        blockFileMap.Close(nFile);
+        boost::system::error_code ec;
+        filesystem::remove(BlockFilePath(nFile), ec);
+        if (ec)
+            LogPrintf("PruneBlockFiles() : removing block file %u failed: %s\n", nFile, ec.message());
+        else
+            setPrunedBlockFiles.insert(nFile);
+    }
+    LogPrintf("PruneBlockFiles(): removed %u block files (%dMiB), %dMiB left\n",
+        setPrune.size(), nPrunedSize >> 20, (nTotalSize - nPrunedSize) >> 20);
+}
+
+// Block index entries are never freed, so they are bump-allocated out of
+// chunks: this saves the per-allocation overhead of millions of small objects
+// and keeps entries loaded together close in memory.
+static const unsigned int BLOCK_INDEX_ARENA_CHUNK = 4096;
+static CCriticalSection cs_blockindexarena;
+static unsigned char* pBlockIndexChunk = NULL;
+static unsigned int nBlockIndexChunkUsed = BLOCK_INDEX_ARENA_CHUNK;
+static size_t nBlockIndexArenaBytes = 0;
+
+void* AllocBlockIndex()
+{
+    LOCK(cs_blockindexarena);
+    if (nBlockIndexChunkUsed == BLOCK_INDEX_ARENA_CHUNK)
+    {
+        // ::operator new returns memory aligned for any object type
+        pBlockIndexChunk = static_cast<unsigned char*>(::operator new(BLOCK_INDEX_ARENA_CHUNK * sizeof(CBlockIndex)));
+        nBlockIndexChunkUsed = 0;
+        nBlockIndexArenaBytes += BLOCK_INDEX_ARENA_CHUNK * sizeof(CBlockIndex);
+    }
+    return pBlockIndexChunk + sizeof(CBlockIndex) * nBlockIndexChunkUsed++;
+}
+
+size_t GetBlockIndexArenaBytes()
+{
+    LOCK(cs_blockindexarena);
+    return nBlockIndexArenaBytes;
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     LOCK(cs_main);
@@ -2607,7 +3899,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2675,65 +3967,282 @@ void PrintBlockTree()
     }
 }
 
+//
+// Importing external block files
+//
+// Importing runs as a pipeline. A reader thread reads the file sequentially
+// in large chunks and cuts it into block frames. The frames are deserialized,
+// hashed and checked in batches on worker threads. The import thread then
+// hands each batch to ProcessBlock in file order, holding cs_main for the
+// whole batch instead of taking it for every block.
+//
+
+static const unsigned int IMPORT_BATCH_BLOCKS = 128;
+static const unsigned int IMPORT_MAX_BATCHES = 4;
+static const size_t IMPORT_READ_BUFFER = 16 << 20;
+static const int64_t IMPORT_MAX_LOCK_MILLIS = 500;
+
+// One block frame of an external block file
+struct CImportBlock
+{
+    std::vector<char> vchBlock;
+    CBlock block;
+    bool fValid;
+    bool fChecked;
+};
+
+// Deserializes and checks one block of a batch
+class CImportBlockCheck
+{
+private:
+    CImportBlock* pimport;
+
+public:
+    CImportBlockCheck() : pimport(NULL) {}
+    CImportBlockCheck(CImportBlock* pimportIn) : pimport(pimportIn) {}
+
+    bool operator()()
+    {
+        try {
+            CDataStream ss(pimport->vchBlock, SER_DISK, CLIENT_VERSION);
+            ss >> pimport->block;
+            pimport->fValid = true;
+        }
+        catch (std::exception &e) {
+            pimport->fValid = false;
+            return true;
+        }
+        pimport->fChecked = pimport->block.CheckBlock();
+        std::vector<char>().swap(pimport->vchBlock);
+        return true;
+    }
+
+    void swap(CImportBlockCheck& check)
+    {
+        std::swap(pimport, check.pimport);
+    }
+};
+
+// Reads block frames out of an external block file ahead of the importer
+class CImportReader
+{
+private:
+    FILE* file;
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condReady;
+    std::deque<std::vector<CImportBlock> > queueBatches;
+    bool fEnd;
+    bool fStop;
+    uint64_t nBytesRead;
+
+    std::vector<char> vBuffer;
+    size_t nBegin, nEnd;
+
+    // Makes at least nNeed bytes available from nBegin, if the file has them
+    bool Fill(size_t nNeed)
+    {
+        if (nEnd - nBegin >= nNeed)
+            return true;
+        memmove(&vBuffer[0], &vBuffer[nBegin], nEnd - nBegin);
+        nEnd -= nBegin;
+        nBegin = 0;
+        while (nEnd < nNeed)
+        {
+            size_t nRead = fread(&vBuffer[nEnd], 1, vBuffer.size() - nEnd, file);
+            if (nRead == 0)
+                return false;
+            nEnd += nRead;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nBytesRead += nRead;
+        }
+        return true;
+    }
+
+    // Finds the next frame; false at the end of the file
+    bool ReadFrame(CImportBlock& import)
+    {
+        const unsigned char* pchMessageStart = Params().MessageStart();
+        while (Fill(MESSAGE_START_SIZE + sizeof(unsigned int)))
+        {
+            const char* pbegin = &vBuffer[nBegin];
+            const char* pfind = (const char*)memchr(pbegin, pchMessageStart[0], nEnd - nBegin - MESSAGE_START_SIZE + 1);
+            if (!pfind)
+            {
+                nBegin = nEnd - MESSAGE_START_SIZE + 1;
+                continue;
+            }
+            nBegin += pfind - pbegin;
+            if (memcmp(pfind, pchMessageStart, MESSAGE_START_SIZE) != 0)
+            {
+                nBegin++;
+                continue;
+            }
+
+            unsigned int nSize;
+            memcpy(&nSize, &vBuffer[nBegin + MESSAGE_START_SIZE], sizeof(nSize));
+            size_t nHeader = MESSAGE_START_SIZE + sizeof(nSize);
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE || !Fill(nHeader + nSize))
+            {
+                // Not a frame after all; look on from the next byte
+                nBegin++;
+                continue;
+            }
+            import.vchBlock.assign(vBuffer.begin() + nBegin + nHeader, vBuffer.begin() + nBegin + nHeader + nSize);
+            import.fValid = false;
+            import.fChecked = false;
+            nBegin += nHeader + nSize;
+            return true;
+        }
+        return false;
+    }
+
+public:
+    CImportReader(FILE* fileIn) : file(fileIn), fEnd(false), fStop(false), nBytesRead(0), vBuffer(IMPORT_READ_BUFFER), nBegin(0), nEnd(0) {}
+
+    void Thread()
+    {
+        bool fMore = true;
+        while (fMore)
+        {
+            std::vector<CImportBlock> vBatch;
+            vBatch.reserve(IMPORT_BATCH_BLOCKS);
+            while (vBatch.size() < IMPORT_BATCH_BLOCKS)
+            {
+                vBatch.push_back(CImportBlock());
+                if (!ReadFrame(vBatch.back()))
+                {
+                    vBatch.pop_back();
+                    fMore = false;
+                    break;
+                }
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queueBatches.size() >= IMPORT_MAX_BATCHES && !fStop)
+                condRead.wait(lock);
+            if (fStop)
+                break;
+            queueBatches.push_back(std::vector<CImportBlock>());
+            queueBatches.back().swap(vBatch);
+            condReady.notify_one();
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fEnd = true;
+        condReady.notify_one();
+    }
+
+    // Takes the next batch; false once the file is done
+    bool Next(std::vector<CImportBlock>& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queueBatches.empty() && !fEnd)
+            condReady.wait(lock);
+        if (queueBatches.empty())
+            return false;
+        vBatch.swap(queueBatches.front());
+        queueBatches.pop_front();
+        condRead.notify_one();
+        return true;
+    }
+
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condRead.notify_one();
+    }
+
+    uint64_t GetBytesRead()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nBytesRead;
+    }
+};
+
+// Stops the pipeline threads however the import ends
+struct CImportThreads
+{
+    boost::thread_group threads;
+    CImportReader& reader;
+
+    CImportThreads(CImportReader& readerIn) : reader(readerIn) {}
+    ~CImportThreads()
+    {
+        reader.Stop();
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+
+static void LogImportProgress(int nLoaded, uint64_t nBytes, int64_t nStart)
+{
+    double dSeconds = std::max((GetTimeMillis() - nStart) / 1000.0, 0.001);
+    LogPrintf("Imported %d blocks, %.1f blocks/s, %.1f MB/s\n", nLoaded, nLoaded / dSeconds, nBytes / dSeconds / 1000000.0);
+}
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+    if (!blkdat)
+        return false;
+    CImportReader reader(blkdat);
+    CCheckQueue<CImportBlockCheck> queue(16);
     {
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+        CImportThreads pipeline(reader);
+        pipeline.threads.create_thread(boost::bind(&CImportReader::Thread, &reader));
+        for (int i = 0; i < nScriptCheckThreads; i++)
+            pipeline.threads.create_thread(boost::bind(&CCheckQueue<CImportBlockCheck>::Thread, &queue));
+
+        int64_t nLastLog = GetTimeMillis();
+        std::vector<CImportBlock> vBatch;
+        while (reader.Next(vBatch))
+        {
+            boost::this_thread::interruption_point();
+
+            // Decode and check the whole batch at once
             {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                CCheckQueueControl<CImportBlockCheck> control(&queue);
+                std::vector<CImportBlockCheck> vChecks;
+                vChecks.reserve(vBatch.size());
+                BOOST_FOREACH(CImportBlock& import, vBatch)
+                    vChecks.push_back(CImportBlockCheck(&import));
+                control.Add(vChecks);
+                control.Wait();
+            }
+
+            // Connect in file order, letting go of cs_main now and then so
+            // that the node stays responsive
+            unsigned int i = 0;
+            while (i < vBatch.size())
+            {
+                LOCK(cs_main);
+                int64_t nLockStart = GetTimeMillis();
+                for (; i < vBatch.size() && GetTimeMillis() - nLockStart < IMPORT_MAX_LOCK_MILLIS; i++)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
+                    CImportBlock& import = vBatch[i];
+                    if (!import.fValid)
+                        continue;
+                    // Blocks that fail the checks go through ProcessBlock
+                    // again, which logs why
+                    if (ProcessBlock(NULL, &import.block, import.fChecked))
                         nLoaded++;
-                        nPos += 4 + nSize;
-                    }
                 }
             }
-        }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+
+            if (GetTimeMillis() - nLastLog > 10000)
+            {
+                LogImportProgress(nLoaded, reader.GetBytesRead(), nStart);
+                nLastLog = GetTimeMillis();
+            }
         }
     }
+
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    LogImportProgress(nLoaded, reader.GetBytesRead(), nStart);
     return nLoaded > 0;
 }
 
@@ -2750,6 +4259,38 @@ struct CImportingNow
     }
 };
 
+// Resumes LevelDB compactions once the short deferral after a new best block
+// is over, and compacts the whole database once after catching up with the
+// chain, when no new block has come in for a while. Compactions are not
+// deferred while catching up: that would leave level 1 to grow without bound.
+void ThreadScheduleCompaction()
+{
+    RenameThread("altcommunitycoin-compact");
+
+    bool fCatchingUp = false;
+    while (true)
+    {
+        MilliSleep(1000);
+
+        bool fResumed = CTxDB::ResumeCompaction();
+        if (fReindex || fImporting || IsInitialBlockDownload())
+        {
+            fCatchingUp = true;
+            continue;
+        }
+
+        if (!fResumed)
+            continue;
+
+        if (fCatchingUp && GetTime() - nTimeBestReceived >= DB_COMPACTION_IDLE)
+        {
+            fCatchingUp = false;
+            if (GetBoolArg("-dbdefercompaction", true))
+                CTxDB::Compact();
+        }
+    }
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("altcommunitycoin-loadblk");
@@ -2863,7 +4404,8 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               IsPreValidating(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2893,11 +4435,16 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    if (!block.ReadFromDisk((*mi).second))
+                    {
+                        // Pruned, or gone for some other reason
+                        LogPrint("net", "getdata: cannot read block %s\n", inv.hash.ToString());
+                        continue;
+                    }
 
                     // previous versions could accept sigs with high s
                     if (!IsCanonicalBlockSignature(&block, true)) {
@@ -3191,6 +4738,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
         CTxDB txdb("r");
+        bool fAskedForHeaders = false;
 
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
@@ -3202,7 +4750,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave) {
+            if (fHeadersFirst && inv.type == MSG_BLOCK) {
+                // New blocks are found through their headers and fetched
+                // by the download window, from the peers that announced them
+                UpdateBestHeader(pfrom, inv.hash);
+                if (!fAlreadyHave && !fImporting && !mapHeaderChain.count(inv.hash) && !fAskedForHeaders) {
+                    PushGetHeaders(pfrom);
+                    fAskedForHeaders = true;
+                }
+            } else if (!fAlreadyHave) {
                 if (!fImporting)
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
@@ -3266,6 +4822,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            if (fPruneMode && IsBlockFilePruned(pindex->nFile))
+            {
+                LogPrint("net", "  getblocks stopping at pruned block %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -3290,7 +4851,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3304,7 +4865,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3316,6 +4877,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers" && fHeadersFirst && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+
+        if (!AcceptHeaders(pfrom, vHeaders))
+            return false;
+
+        // A full message means the peer has more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+            PushGetHeaders(pfrom);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3395,11 +4977,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_BLOCK, hashBlock);
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            MarkBlockReceived(hashBlock);
+            fAlreadyHave = mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || IsPreValidating(hashBlock);
+        }
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        // Duplicates are dropped before any checking. Context-free checks
+        // happen before cs_main is taken, on the pre-validation threads while
+        // catching up, or here when their queue is full.
+        if (fAlreadyHave)
+            LogPrint("net", "already have block %s\n", hashBlock.ToString());
+        else if (!(nScriptCheckThreads && IsInitialBlockDownload() && blockprevalidator.Add(pfrom, block, hashBlock)))
+            ProcessCheckedBlock(pfrom, block, block.CheckBlock());
     }
 
 
@@ -3724,7 +5315,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            if (fHeadersFirst)
+                PushGetHeaders(pto);
+            else
+                PushGetBlocks(pto, pindexBest, uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3833,6 +5427,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        if (fHeadersFirst && !fImporting && !fReindex && !pto->fClient && !pto->fDisconnect)
+            FindBlocksToDownload(pto, vGetData);
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
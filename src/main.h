@@ -13,10 +13,13 @@
 #include "script.h"
 #include "scrypt.h"
 #include "hash.h"
+#include "blockfilemap.h"
 
 #include <limits>
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CBlock;
 class CBlockIndex;
 class CInv;
@@ -39,6 +42,10 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Seconds database compactions are deferred after a new best block */
+static const int64_t DB_COMPACTION_TIP_DEFER = 3;
+/** Seconds without a new best block before the database is compacted after catching up */
+static const int64_t DB_COMPACTION_IDLE = 30;
 /** Default for -maxorphanblocksmib, maximum number of memory to keep orphan blocks */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 40;
 /** The maximum number of entries in an 'inv' protocol message */
@@ -54,6 +61,34 @@ inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MO
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 
 static const int64_t COIN_YEAR_REWARD = 180 * CENT; // 5% per year
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of received blocks waiting for or in pre-validation */
+static const unsigned int MAX_PREVALIDATION_BLOCKS = 64;
+/** Maximum number of headers in a 'headers' message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks past the best block that can be downloaded at once */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum number of blocks requested from one peer at a time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds the block at the start of the download window may wait on one
+ * peer, counted from when it got there, before it is asked from another */
+static const int64_t BLOCK_STALLING_TIMEOUT = 30;
+/** Seconds after which a requested block is given up on */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Times the block at the start of the download window may fail to arrive
+ * before the peer that sent its header is dropped */
+static const int MAX_BLOCK_REQUEST_FAILURES = 4;
+/** Blocks kept on disk under -prune, counted back from the best block */
+static const int MIN_BLOCKS_TO_KEEP = 2880;
+/** Blocks back from the best block that keep an undo record in the txdb;
+ *  deeper reorganizations read the spent coins from the block files */
+static const int UNDO_BLOCKS_TO_KEEP = MIN_BLOCKS_TO_KEEP;
+/** The smallest -prune target, in MiB */
+static const uint64_t MIN_PRUNE_TARGET_MB = 300;
+/** Under -prune new block files are started at this size, so that old ones
+ *  can be removed in smaller steps */
+static const unsigned int PRUNE_BLOCKFILE_SIZE = 128 * 1024 * 1024;
 
 
 inline bool IsProtocolV1RetargetingFixed(int nHeight) { return TestNet() || nHeight > 0; }
@@ -76,7 +111,17 @@ inline unsigned int GetTargetSpacing(int nHeight) { return IsProtocolV2(nHeight)
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/** Hashes block hashes for mapBlockIndex with SipHash under a per-process
+ * key, so peers cannot choose hashes that collide in our buckets. The key is
+ * drawn the first time a hash is taken, not when the map is constructed
+ * during static initialization, before the RNG is seeded. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const;
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -97,6 +142,10 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern int nScriptCheckThreads;
+extern bool fHeadersFirst;
+extern bool fPruneMode;
+extern uint64_t nPruneTarget;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
@@ -108,7 +157,10 @@ extern unsigned int nDerivationMethodIndex;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
+class CCoin;
+class CDiskTxPos;
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -130,29 +182,80 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
+void PushGetHeaders(CNode* pnode);
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked = false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
+boost::filesystem::path BlockFilePath(unsigned int nFile);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
+
+/** Reads obj from block file nFile at nPos, straight out of the memory map of
+ *  the file where there is one. Throws on deserialization errors like the
+ *  file streams do, and returns false if the file cannot be opened. */
+template<typename T>
+bool ReadFromBlockFile(unsigned int nFile, unsigned int nPos, int nType, T& obj)
+{
+    boost::shared_ptr<CBlockFileMapping> mapping = blockFileMap.Get(nFile, (size_t)nPos + 1);
+    for (int nTry = 0; mapping && nTry < 2; nTry++)
+    {
+        try {
+            CSpanReader(mapping->pdata + nPos, mapping->pdata + mapping->nSize, nType, CLIENT_VERSION) >> obj;
+            return true;
+        }
+        catch (std::ios_base::failure &e) {
+            // The object may run past the part of the file that was mapped,
+            // if it was written since: map the file again if it has grown,
+            // and let the file itself tell otherwise
+            mapping = blockFileMap.Get(nFile, mapping->nSize + 1);
+        }
+    }
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nPos, "rb"), nType, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    filein >> obj;
+    return true;
+}
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Removes the oldest block files while they take more than nPruneTarget */
+void PruneBlockFiles();
+/** True if block file nFile was removed by -prune */
+bool IsBlockFilePruned(unsigned int nFile);
 bool LoadBlockIndex(bool fAllowNew=true);
+/** Returns storage for one CBlockIndex, to be constructed with placement new.
+ *  Block index entries live as long as the process and are carved out of large
+ *  chunks instead of being allocated one by one. */
+void* AllocBlockIndex();
+/** Bytes reserved by AllocBlockIndex so far */
+size_t GetBlockIndexArenaBytes();
 void PrintBlockTree();
-CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Defer database compactions during sync and run them when idle */
+void ThreadScheduleCompaction();
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Run CheckBlock on blocks received during initial download */
+void ThreadBlockPreValidation();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
 int64_t GetProofOfWorkReward(int64_t nFees);
 int64_t GetProofOfStakeReward(const CBlockIndex* pindexPrev, int64_t nCoinAge, int64_t nFees);
 bool IsInitialBlockDownload();
-bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
+bool IsConfirmedInNPrevBlocks(const CDiskTxPos& txpos, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
+bool GetCoin(CTxDB& txdb, const COutPoint& prevout, CCoin& coin);
+bool ReadCoinFromDisk(const COutPoint& prevout, const CTxIndex& txindex, CCoin& coin);
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
+/** Closes and removes the file orphan blocks are spilled to */
+void CloseOrphanBlockFile();
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
+/** Wakes the staking thread up to try again now */
+void WakeStaker();
 
 
 /** (try to) add transaction to memory pool **/
@@ -211,6 +314,25 @@ public:
     }
 };
 
+/** wrapper for CDiskTxPos that serializes it as varints, with the position of
+ *  the transaction relative to its block */
+class CDiskTxPosCompressor
+{
+private:
+    CDiskTxPos &pos;
+public:
+    CDiskTxPosCompressor(CDiskTxPos &posIn) : pos(posIn) { }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(VARINT(pos.nFile));
+        READWRITE(VARINT(pos.nBlockPos));
+        unsigned int nTxOffset = pos.nTxPos - pos.nBlockPos;
+        READWRITE(VARINT(nTxOffset));
+        if (fRead)
+            pos.nTxPos = pos.nBlockPos + nTxOffset;
+    )
+};
+
 
 
 
@@ -320,6 +442,18 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            try {
+                if (!ReadFromBlockFile(pos.nFile, pos.nTxPos, SER_DISK, *this))
+                    return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -381,7 +515,10 @@ public:
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet);
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout);
     bool ReadFromDisk(COutPoint prevout);
-    bool DisconnectInputs(CTxDB& txdb);
+    /** Undo the effects of this transaction on the txindex and coin set.
+        @param[in] pcoinsSpent	the coins spent by vin, from the undo record of the block,
+                                or NULL to rebuild them from the block files */
+    bool DisconnectInputs(CTxDB& txdb, const CCoin* pcoinsSpent = NULL);
 
     /** Fetch from memory and/or disk. inputsRet keys are transaction hashes.
 
@@ -391,10 +528,18 @@ public:
      @param[in] fMiner	True if being called by CreateNewBlock
      @param[out] inputsRet	Pointers to this transaction's inputs
      @param[out] fInvalid	returns true if transaction is invalid
+     @param[in] pmapQueuedCoins	Optional list of pending changes to the coin set
+     @param[out] pvCoinsRet	Optional, gets the coin each input spends, or a null
+                            coin for the inputs that were not taken from the coin set
      @return	Returns true if all inputs are in txdb or mapTestPool
+
+     Inputs that are still unspent are rebuilt from the coin set instead of
+     being read from the block files; see CCoin.
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid,
+                     const std::map<COutPoint, CCoin>* pmapQueuedCoins = NULL,
+                     std::vector<CCoin>* pvCoinsRet = NULL);
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -405,11 +550,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	If not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -459,6 +606,33 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason);
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
+/** Closure representing one script verification.
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 
 
 /** A transaction with a merkle branch linking it to the block chain. */
@@ -522,6 +696,12 @@ public:
 /**  A txdb record that contains the disk location of a transaction and the
  * locations of transactions that spend its outputs.  vSpent is really only
  * used as a flag, but having the location is very helpful for debugging.
+ *
+ * On disk the record only holds a bitmap of the spent outputs, and the
+ * location of each spend is a record of its own (see CTxDB::UpdateTxIndex),
+ * so that spending one output does not rewrite the locations of all others.
+ * Spent outputs of a record read back from disk are SpentPosUnread() until
+ * CTxDB::ReadTxSpentPositions fills them in.
  */
 class CTxIndex
 {
@@ -542,10 +722,25 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
-        if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
-        READWRITE(pos);
-        READWRITE(vSpent);
+        CTxIndex* pthis = const_cast<CTxIndex*>(this);
+        READWRITE(REF(CDiskTxPosCompressor(REF(pthis->pos))));
+        unsigned int nOutputs = vSpent.size();
+        READWRITE(VARINT(nOutputs));
+        if (fRead)
+            pthis->vSpent.assign(nOutputs, CDiskTxPos());
+        for (unsigned int i = 0; i < nOutputs; i += 8)
+        {
+            unsigned char chSpent = 0;
+            if (!fRead)
+                for (unsigned int j = i; j < i + 8 && j < nOutputs; j++)
+                    if (!vSpent[j].IsNull())
+                        chSpent |= 1 << (j - i);
+            READWRITE(chSpent);
+            if (fRead)
+                for (unsigned int j = i; j < i + 8 && j < nOutputs; j++)
+                    if (chSpent & (1 << (j - i)))
+                        pthis->vSpent[j] = SpentPosUnread();
+        }
     )
 
     void SetNull()
@@ -554,6 +749,13 @@ public:
         vSpent.clear();
     }
 
+    // Marks an output read back from disk as spent, at a location that is
+    // stored in a separate record. No transaction is in block file 0.
+    static CDiskTxPos SpentPosUnread()
+    {
+        return CDiskTxPos(0, 0, 0);
+    }
+
     bool IsNull()
     {
         return pos.IsNull();
@@ -574,6 +776,114 @@ public:
 };
 
 
+/** A txdb record for a single unspent transaction output.  Besides the output
+ * itself it keeps what input validation and the stake kernel need to know
+ * about the transaction that created it, so that neither has to read that
+ * transaction back from the block files.
+ */
+class CCoin
+{
+public:
+    enum
+    {
+        COIN_COINBASE  = (1U << 0),
+        COIN_COINSTAKE = (1U << 1),
+    };
+
+    CTxOut txout;
+    CDiskTxPos pos;             // location of the creating transaction
+    int nHeight;                // height of the block containing it
+    unsigned int nTime;         // timestamp of the creating transaction
+    unsigned int nBlockTime;    // timestamp of the block containing it
+    unsigned int nFlags;
+
+    CCoin()
+    {
+        SetNull();
+    }
+
+    CCoin(const CTransaction& tx, unsigned int n, const CDiskTxPos& posIn, int nHeightIn, unsigned int nBlockTimeIn)
+    {
+        txout = tx.vout[n];
+        pos = posIn;
+        nHeight = nHeightIn;
+        nTime = tx.nTime;
+        nBlockTime = nBlockTimeIn;
+        nFlags = 0;
+        if (tx.IsCoinBase())
+            nFlags |= COIN_COINBASE;
+        if (tx.IsCoinStake())
+            nFlags |= COIN_COINSTAKE;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CTxOutCompressor txoutc(REF(txout));
+        READWRITE(txoutc);
+        READWRITE(pos);
+        READWRITE(VARINT(nHeight));
+        READWRITE(nTime);
+        READWRITE(nBlockTime);
+        READWRITE(VARINT(nFlags));
+    )
+
+    void SetNull()
+    {
+        txout.SetNull();
+        pos.SetNull();
+        nHeight = 0;
+        nTime = 0;
+        nBlockTime = 0;
+        nFlags = 0;
+    }
+
+    bool IsNull() const
+    {
+        return txout.IsNull();
+    }
+
+    bool IsCoinBase() const
+    {
+        return (nFlags & COIN_COINBASE) != 0;
+    }
+
+    bool IsCoinStake() const
+    {
+        return (nFlags & COIN_COINSTAKE) != 0;
+    }
+
+    // Offset of the creating transaction inside its block, as used by the
+    // v1 stake kernel
+    unsigned int GetTxOffset() const
+    {
+        return pos.nTxPos - pos.nBlockPos;
+    }
+
+    std::string ToString() const
+    {
+        return strprintf("CCoin(%s, pos=%s, nHeight=%d, nTime=%u, nBlockTime=%u, nFlags=%u)",
+            txout.ToString(), pos.ToString(), nHeight, nTime, nBlockTime, nFlags);
+    }
+};
+
+
+
+/** Undo information of a connected block: the coins spent by the inputs of
+ *  its transactions, in block order. Disconnecting the block puts them back
+ *  into the coin set without reading the previous transactions from disk.
+ */
+class CBlockUndo
+{
+public:
+    std::vector<CCoin> vSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vSpent);
+    )
+};
+
+
 
 
 
@@ -794,16 +1104,10 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
         // Read block
         try {
-            filein >> *this;
+            if (!ReadFromBlockFile(nFile, nBlockPos, fReadTransactions ? SER_DISK : SER_DISK | SER_BLOCKHEADERONLY, *this))
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1108,6 +1412,7 @@ public:
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        blockHash = (phashBlock ? *phashBlock : 0);
     }
 
     IMPLEMENT_SERIALIZE
@@ -1183,6 +1488,63 @@ public:
 
 
 
+/** The blocks of a chain indexed by height, so that looking a block up by
+ * height does not have to walk pprev/pnext pointers. The active chain is
+ * chainActive; it is kept at pindexBest by SetBestChain and protected by
+ * cs_main.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the genesis block of this chain, or NULL if it is empty */
+    CBlockIndex* Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Returns the last block of this chain, or NULL if it is empty */
+    CBlockIndex* Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Returns the block at height nHeight, or NULL if there is none */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Whether pindex is part of this chain */
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Returns the block after pindex in this chain, or NULL if there is none */
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    /** Returns the height of the tip, or -1 if the chain is empty */
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Makes pindex the tip; only the blocks past the fork point are replaced */
+    void SetTip(CBlockIndex* pindex);
+};
+
+extern CChain chainActive;
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1204,7 +1566,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1255,7 +1617,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1274,7 +1636,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1290,7 +1652,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -514,6 +514,44 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
     return true;
 }
 
+// The staking thread sleeps on this between attempts, until the next stake
+// timestamp slot or until something it stakes on changes
+static boost::mutex csStakerWake;
+static boost::condition_variable condStakerWake;
+static bool fStakerWake = false;
+
+void WakeStaker()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(csStakerWake);
+        fStakerWake = true;
+    }
+    condStakerWake.notify_all();
+}
+
+static void StakerWait(int64_t nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(csStakerWake);
+    if (!fStakerWake && nMilliseconds > 0)
+        condStakerWake.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+    fStakerWake = false;
+}
+
+static void WakeStakerOnTransaction(CWallet* wallet, const uint256& hashTx, ChangeType status)
+{
+    WakeStaker();
+}
+
+static void WakeStakerOnStatus(CCryptoKeyStore* wallet)
+{
+    WakeStaker();
+}
+
+static void WakeStakerOnConnections(int nConnections)
+{
+    WakeStaker();
+}
+
 void ThreadStakeMiner(CWallet *pwallet)
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -523,51 +561,78 @@ void ThreadStakeMiner(CWallet *pwallet)
 
     CReserveKey reservekey(pwallet);
 
+    // New tips wake the thread from SetBestChain; wallet changes, unlocking
+    // the wallet and new connections wake it from here
+    boost::signals2::scoped_connection connTransaction(pwallet->NotifyTransactionChanged.connect(boost::bind(&WakeStakerOnTransaction, _1, _2, _3)));
+    boost::signals2::scoped_connection connStatus(pwallet->NotifyStatusChanged.connect(boost::bind(&WakeStakerOnStatus, _1)));
+    boost::signals2::scoped_connection connConnections(uiInterface.NotifyNumConnectionsChanged.connect(boost::bind(&WakeStakerOnConnections, _1)));
+
     bool fTryToSync = true;
 
+    // The block template is kept between attempts and only rebuilt when the
+    // tip or the memory pool changed, or after a minute so that transactions
+    // that were not final or were timestamped ahead get in
+    auto_ptr<CBlock> pblock;
+    int64_t nFees = 0;
+    unsigned int nTransactionsUpdatedLast = 0;
+    int64_t nTemplateTime = 0;
+
     while (true)
     {
         while (pwallet->IsLocked())
         {
             nLastCoinStakeSearchInterval = 0;
-            MilliSleep(1000);
+            StakerWait(60000);
         }
 
         while (vNodes.empty() || IsInitialBlockDownload())
         {
             nLastCoinStakeSearchInterval = 0;
             fTryToSync = true;
-            MilliSleep(1000);
+            StakerWait(1000);
         }
 
         if (fTryToSync)
         {
+            // Give the node up to a minute to catch up with its peers
             fTryToSync = false;
-            if (vNodes.size() < 3 || pindexBest->GetBlockTime() < GetTime() - 10 * 60)
-            {
-                MilliSleep(60000);
-                continue;
-            }
+            int64_t nSyncDeadline = GetTime() + 60;
+            while ((vNodes.size() < 3 || pindexBest->GetBlockTime() < GetTime() - 10 * 60) && GetTime() < nSyncDeadline)
+                StakerWait(1000 * (nSyncDeadline - GetTime()));
+            continue;
         }
 
         //
         // Create new block
         //
-        int64_t nFees;
-        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
-        if (!pblock.get())
-            return;
+        if (!pblock.get() || pblock->hashPrevBlock != hashBestChain ||
+            mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast || GetTime() - nTemplateTime > 60)
+        {
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            nTemplateTime = GetTime();
+            pblock.reset(CreateNewBlock(reservekey, true, &nFees));
+            if (!pblock.get())
+                return;
+        }
 
-        // Trying to sign a block
-        if (pblock->SignBlock(*pwallet, nFees))
+        // Trying to sign a block. SignBlock adds the coinstake to the block
+        // before it signs, and signing can still fail, so it works on a copy
+        // and the template stays clean.
+        CBlock block(*pblock);
+        if (block.SignBlock(*pwallet, nFees))
         {
             SetThreadPriority(THREAD_PRIORITY_NORMAL);
-            CheckStake(pblock.get(), *pwallet);
+            CheckStake(&block, *pwallet);
             SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            MilliSleep(500);
         }
+
+        // A kernel can only be found again once the coinstake timestamp
+        // moves to the next slot, so sleep until then unless woken up
+        int64_t nNow = GetAdjustedTime();
+        if (IsProtocolV2(nBestHeight+1))
+            StakerWait(1000 * ((nNow | STAKE_TIMESTAMP_MASK) + 1 - nNow));
         else
-            MilliSleep(nMinerSleep);
+            StakerWait(nMinerSleep);
     }
 }
 
@@ -580,6 +645,9 @@ void ThreadStakeMiner(CWallet *pwallet)
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
+// Nonces hashed between checks of the miner loop conditions
+static const unsigned int MINER_NONCE_BATCH = 256;
+
 void static BitcoinMiner(CWallet *pwallet)
 {
     LogPrintf("BRAINHasher Miner started\n");
@@ -616,52 +684,62 @@ void static BitcoinMiner(CWallet *pwallet)
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 */
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-	int64_t nStart = GetTime();
-	uint256 hash;
-	unsigned int nHashesDone = 0;
+        int64_t nStart = GetTime();
+
+        // Everything in front of the nonce stays the same until nTime moves
+        CSkunkHash5Midstate midstate;
+        midstate.Init(BEGIN(pblock->nVersion));
+        uint256 vHashes[MINER_NONCE_BATCH];
 
         while (true)
-        {            
-            hash = pblock->GetPoWHash();
-	    ++nHashesDone;
-            
-            if (hash <= hashTarget)
+        {
+            midstate.HashBatch(pblock->nNonce, MINER_NONCE_BATCH, vHashes);
+
+            bool fFound = false;
+            for (unsigned int i = 0; i < MINER_NONCE_BATCH; i++)
             {
-                // Found a solution
-                SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                CheckWork(pblock, *pwallet, reservekey);
-                SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                if (vHashes[i] <= hashTarget)
+                {
+                    // Found a solution
+                    pblock->nNonce += i;
+                    if (pblock->GetPoWHash() != vHashes[i])
+                    {
+                        LogPrintf("ERROR: BRAINHash Miner : batch hash of nonce %u does not match the block\n", pblock->nNonce);
+                        pblock->nNonce -= i;
+                        continue;
+                    }
+                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                    CheckWork(pblock, *pwallet, reservekey);
+                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    fFound = true;
+                    break;
+                }
+            }
+            if (fFound)
                 break;
-            }       
-	    ++pblock->nNonce;    
+            pblock->nNonce += MINER_NONCE_BATCH;
 
             // Meter hashes/sec
             static int64_t nHashCounter;
             if (nHPSTimerStart == 0)
             {
-                nHPSTimerStart = GetTime();
+                nHPSTimerStart = GetTimeMillis();
                 nHashCounter = 0;
             }
             else
-                ++nHashCounter;// += nHashesDone;
-            if ((GetTime() - nHPSTimerStart) % 4 == 0)
+                nHashCounter += MINER_NONCE_BATCH;
+            if (GetTimeMillis() - nHPSTimerStart > 4000)
             {
                 static CCriticalSection cs;
                 {
                     LOCK(cs);
-		    int64_t nLimiter = 1;
-                    int64_t nDelta = GetTime() - nHPSTimerStart;
-		    if(nDelta > 0 && nLimiter <= 10+1)
-                        dHashesPerSec = 32768 * nHashCounter / (GetTime() - nHPSTimerStart);
-                        //nHPSTimerStart = GetTimeMillis();
-                        //nHashCounter = 0;
-			//nHashesDone = 0;
-                        // LogPrintf("BRAINHash CPU Hashing Rate: %6.0f hash/s\n", dHashesPerSec);
-			// Avoid Debug Log Pollution
-			nLimiter++; // Increment by 1
-                        if (nLimiter >= 5000+1){
-                                nLimiter = 1;
-                        }
+                    if (GetTimeMillis() - nHPSTimerStart > 4000)
+                    {
+                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
+                        nHPSTimerStart = GetTimeMillis();
+                        nHashCounter = 0;
+                        LogPrint("miner", "BRAINHash CPU Hashing Rate: %6.0f hash/s\n", dHashesPerSec);
+                    }
                 }
             }
 
@@ -677,8 +755,11 @@ void static BitcoinMiner(CWallet *pwallet)
                 break;
 
             // Update nTime every few seconds
- 	    pblock->UpdateTime(pindexPrev);
-            
+            unsigned int nTimeOld = pblock->nTime;
+            pblock->UpdateTime(pindexPrev);
+            if (pblock->nTime != nTimeOld)
+                midstate.Init(BEGIN(pblock->nVersion));
+
             if (TestNet())
             {
                 // Changing pblock->nTime can change work required on testnet:
@@ -701,6 +701,8 @@ void ThreadSocketHandler()
             list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
             BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
             {
+                g_signals.FinalizeNode(pnode);
+
                 // wait until threads are done using it
                 if (pnode->GetRefCount() <= 0)
                 {
@@ -54,6 +54,8 @@ struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    // Called for a disconnected node until it is deleted
+    boost::signals2::signal<void (CNode*)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -227,6 +229,12 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
+    // Best header the peer has announced, for headers-first download, when
+    // it was last asked for the headers of the download window, and the
+    // number of blocks requested from it
+    uint256 hashBestHeader;
+    int64_t nLastGetWindowHeaders;
+    int nBlocksInFlight;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
@@ -279,6 +287,9 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        hashBestHeader = 0;
+        nLastGetWindowHeaders = 0;
+        nBlocksInFlight = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
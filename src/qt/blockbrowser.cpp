@@ -89,25 +89,18 @@ int getBlockHashrate(int height)
 
 const CBlockIndex* getBlockIndex(int height)
 {
-    std::string hex = getBlockHash(height);
-    uint256 hash(hex);
-    return mapBlockIndex[hash];
+    LOCK(cs_main);
+    const CBlockIndex* pblockindex = chainActive[height];
+    return pblockindex ? pblockindex : chainActive.Genesis();
 }
 
 std::string getBlockHash(int Height)
 {
-    if(Height > pindexBest->nHeight) { return "00000f14896ba98013ed07e0ecf6e29b360a20898aab5c23238fd08c17ac1b10"; }
-    if(Height < 0) { return "00000f14896ba98013ed07e0ecf6e29b360a20898aab5c23238fd08c17ac1b10"; }
-    int desiredheight;
-    desiredheight = Height;
-    if (desiredheight < 0 || desiredheight > nBestHeight)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > desiredheight)
-        pblockindex = pblockindex->pprev;
-    return pblockindex->phashBlock->GetHex();
+    LOCK(cs_main);
+    const CBlockIndex* pblockindex = chainActive[Height];
+    if (!pblockindex)
+        return "00000f14896ba98013ed07e0ecf6e29b360a20898aab5c23238fd08c17ac1b10";
+    return pblockindex->GetBlockHash().GetHex();
 }
 
 int getBlockTime(int Height)
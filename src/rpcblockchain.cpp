@@ -7,6 +7,7 @@
 #include "main.h"
 #include "kernel.h"
 #include "checkpoints.h"
+#include "txdb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -224,8 +225,7 @@ Value getblockhash(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
-    return pblockindex->phashBlock->GetHex();
+    return chainActive[nHeight]->GetBlockHash().GetHex();
 }
 
 Value getblock(const Array& params, bool fHelp)
@@ -262,18 +262,56 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = chainActive[nHeight];
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing signature cache statistics.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("entries", stats.nEntries));
+    obj.push_back(Pair("capacity", stats.nCapacity));
+    obj.push_back(Pair("bytes", stats.nBytes));
+    obj.push_back(Pair("hits", stats.nHits));
+    obj.push_back(Pair("misses", stats.nMisses));
+    obj.push_back(Pair("inserts", stats.nInserts));
+    obj.push_back(Pair("evictions", stats.nEvictions));
+    return obj;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns the number of files at each level of the block database and LevelDB's leveldb.stats report.");
+
+    Object obj;
+    Array levels;
+    for (int nLevel = 0; nLevel < 7; nLevel++)
+    {
+        std::string strFiles;
+        if (!CTxDB::GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strFiles))
+            break;
+        levels.push_back(atoi(strFiles));
+    }
+    obj.push_back(Pair("files-at-level", levels));
+    std::string strStats;
+    if (CTxDB::GetProperty("leveldb.stats", strStats))
+        obj.push_back(Pair("stats", strStats));
+    return obj;
+}
+
 // ppcoin: get information of sync-checkpoint
 Value getcheckpoint(const Array& params, bool fHelp)
 {
@@ -4,8 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1337,64 +1336,170 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
-
+//
+// Entries are a salted hash of (signature hash, signature, public key), so a
+// lookup never allocates and every entry is the same 32 bytes. The table is
+// allocated once, split into shards with a lock each so that the script check
+// threads rarely wait for one another, and each shard is a set of two-entry
+// buckets that fit in a cache line. A full bucket loses one of its entries;
+// which one depends on the salted key, so an attacker cannot choose the
+// entries that get evicted.
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct CBucket
+    {
+        uint256 entry[SIGCACHE_BUCKET_ENTRIES];
+    };
+
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<CBucket> vBuckets;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nInserts;
+        uint64_t nEvictions;
+        uint64_t nEntries;
+        size_t nBucketMask;     // set together with vBuckets, under cs
+
+        CShard() : nHits(0), nMisses(0), nInserts(0), nEvictions(0), nEntries(0), nBucketMask(0) {}
+    };
+
+    uint256 nonce;
+    CShard shards[SIGCACHE_SHARDS];
+
+    uint256 ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nonce << hash << vchSig << pubKey;
+        return ss.GetHash();
+    }
+
+    CShard& GetShard(const uint256& entry)
+    {
+        return shards[entry.GetLow64() % SIGCACHE_SHARDS];
+    }
+
+    CBucket& GetBucket(CShard& shard, const uint256& entry)
+    {
+        return shard.vBuckets[(entry.GetLow64() / SIGCACHE_SHARDS) & shard.nBucketMask];
+    }
 
 public:
+    CSignatureCache()
+    {
+        nonce = GetRandHash();
+        Resize((size_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    }
+
+    // Sets the memory used by the table to at most nBytes, dropping all
+    // entries. Zero disables the cache.
+    void Resize(size_t nBytes)
+    {
+        // Buckets per shard, a power of two
+        size_t nBuckets = nBytes ? 1 : 0;
+        while (nBuckets && nBuckets * 2 * sizeof(CBucket) * SIGCACHE_SHARDS <= nBytes)
+            nBuckets *= 2;
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+        {
+            boost::mutex::scoped_lock lock(shards[i].cs);
+            std::vector<CBucket>(nBuckets).swap(shards[i].vBuckets);
+            shards[i].nBucketMask = nBuckets ? nBuckets - 1 : 0;
+            shards[i].nEntries = 0;
+        }
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = GetShard(entry);
+        boost::mutex::scoped_lock lock(shard.cs);
+        if (shard.vBuckets.empty())
+            return false;
+        const CBucket& bucket = GetBucket(shard, entry);
+        for (unsigned int i = 0; i < SIGCACHE_BUCKET_ENTRIES; i++)
+        {
+            if (bucket.entry[i] == entry)
+            {
+                shard.nHits++;
+                return true;
+            }
+        }
+        shard.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = GetShard(entry);
+        boost::mutex::scoped_lock lock(shard.cs);
+        if (shard.vBuckets.empty())
+            return;
+        CBucket& bucket = GetBucket(shard, entry);
+        shard.nInserts++;
+        for (unsigned int i = 0; i < SIGCACHE_BUCKET_ENTRIES; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (bucket.entry[i] == entry)
+                return;
+            if (bucket.entry[i] == 0)
+            {
+                bucket.entry[i] = entry;
+                shard.nEntries++;
+                return;
+            }
         }
+        // Bucket is full, evict one of its entries
+        bucket.entry[(entry.GetLow64() >> 63) % SIGCACHE_BUCKET_ENTRIES] = entry;
+        shard.nEvictions++;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats = CSignatureCacheStats();
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+        {
+            boost::mutex::scoped_lock lock(shards[i].cs);
+            stats.nHits += shards[i].nHits;
+            stats.nMisses += shards[i].nMisses;
+            stats.nInserts += shards[i].nInserts;
+            stats.nEvictions += shards[i].nEvictions;
+            stats.nEntries += shards[i].nEntries;
+            stats.nCapacity += shards[i].vBuckets.size() * SIGCACHE_BUCKET_ENTRIES;
+            stats.nBytes += shards[i].vBuckets.size() * sizeof(CBucket);
+        }
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void InitSignatureCache()
+{
+    // -maxsigcachesize used to count entries. Old configurations keep their
+    // meaning: one entry is now 32 bytes, and 0 or less still disables it.
+    int64_t nBytes;
+    if (mapArgs.count("-sigcachemib") || !mapArgs.count("-maxsigcachesize"))
+        nBytes = GetArg("-sigcachemib", DEFAULT_MAX_SIG_CACHE_SIZE) << 20;
+    else
+        nBytes = GetArg("-maxsigcachesize", 0) * (int64_t)sizeof(uint256);
+    nBytes = std::max((int64_t)0, std::min(nBytes, (int64_t)MAX_SIG_CACHE_SIZE << 20));
+    GetSignatureCache().Resize((size_t)nBytes);
+}
 
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+{
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -1410,6 +1515,7 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
+    CSignatureCache& signatureCache = GetSignatureCache();
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
 
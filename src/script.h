@@ -709,6 +709,33 @@ public:
 };
 
 
+/** Default for -sigcachemib, the signature cache size in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Largest signature cache, in megabytes, either option can ask for */
+static const unsigned int MAX_SIG_CACHE_SIZE = 4096;
+/** Number of independently locked parts of the signature cache */
+static const unsigned int SIGCACHE_SHARDS = 16;
+/** Entries per signature cache bucket; two 32-byte entries fill a cache line */
+static const unsigned int SIGCACHE_BUCKET_ENTRIES = 2;
+
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+    uint64_t nEntries;
+    uint64_t nCapacity;
+    uint64_t nBytes;
+
+    CSignatureCacheStats() : nHits(0), nMisses(0), nInserts(0), nEvictions(0), nEntries(0), nCapacity(0), nBytes(0) {}
+};
+
+/** Size the signature cache from -sigcachemib, or from the older
+ *  -maxsigcachesize entry count; 0 disables it. Drops its contents. */
+void InitSignatureCache();
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsLowDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsCompressedOrUncompressedPubKey(const valtype &vchPubKey);
@@ -0,0 +1,232 @@
+// Copyright (c) 2016 The altcommunitycoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+
+#include <algorithm>
+#include <vector>
+
+// Multi-lane double SHA-256.
+//
+// Stake kernels are short messages that are all hashed with the same
+// length, so SHA256_LANES of them go through the compression function at
+// once with word i of every message in one vector, the same way
+// skunkhashxn.cpp runs cubehash. The second SHA-256 of a double hash takes
+// the 32-byte digest, which is already the first eight message words of its
+// only block, so nothing is converted between the two passes.
+
+#if defined(__GNUC__)
+#define SHA256_VECTOR
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_DISPATCH
+#endif
+#endif
+
+namespace {
+
+typedef void (*SHA256DLanesFn)(const unsigned char* pin, size_t nLen, size_t nStride, uint256* pout);
+
+// Reference path: one OpenSSL double hash per message
+void SHA256DLanesScalar(const unsigned char* pin, size_t nLen, size_t nStride, uint256* pout)
+{
+    for (unsigned int i = 0; i < SHA256_LANES; i++)
+        pout[i] = Hash(pin + i * nStride, pin + i * nStride + nLen);
+}
+
+#ifdef SHA256_VECTOR
+typedef uint32_t lanes_t __attribute__((vector_size(4 * SHA256_LANES)));
+
+static const uint32_t SHA256_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define LANES_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+// One SHA-256 compression of block w into state s on every lane. The
+// message schedule is kept as a ring of 16 words; the loop is left for the
+// compiler, which unrolls it at -O2.
+static inline __attribute__((always_inline)) void SHA256Transform(lanes_t* s, lanes_t* w)
+{
+    lanes_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+        {
+            lanes_t w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            w[i & 15] += (LANES_ROTR(w15, 7) ^ LANES_ROTR(w15, 18) ^ (w15 >> 3)) + w[(i - 7) & 15] +
+                (LANES_ROTR(w2, 17) ^ LANES_ROTR(w2, 19) ^ (w2 >> 10));
+        }
+        lanes_t t1 = h + (LANES_ROTR(e, 6) ^ LANES_ROTR(e, 11) ^ LANES_ROTR(e, 25)) + (g ^ (e & (f ^ g))) + SHA256_K[i] + w[i & 15];
+        lanes_t t2 = (LANES_ROTR(a, 2) ^ LANES_ROTR(a, 13) ^ LANES_ROTR(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+// Double SHA-256 of one nLen-byte message per lane, the messages nStride
+// bytes apart, with the same padding as Hash()
+static inline __attribute__((always_inline)) void SHA256DLanesBody(const unsigned char* pin, size_t nLen, size_t nStride, uint256* pout)
+{
+    lanes_t s[8], w[16];
+    for (int i = 0; i < 8; i++)
+        for (unsigned int j = 0; j < SHA256_LANES; j++)
+            s[i][j] = SHA256_IV[i];
+
+    // Full blocks straight from the input, then the padded tail
+    size_t nFull = nLen / 64;
+    for (size_t nBlock = 0; nBlock < nFull; nBlock++)
+    {
+        for (int i = 0; i < 16; i++)
+            for (unsigned int j = 0; j < SHA256_LANES; j++)
+                w[i][j] = ReadBE32(pin + j * nStride + 64 * nBlock + 4 * i);
+        SHA256Transform(s, w);
+    }
+
+    size_t nRest = nLen - 64 * nFull;
+    size_t nTail = nRest + 9 > 64 ? 128 : 64;
+    unsigned char tail[SHA256_LANES][128];
+    for (unsigned int j = 0; j < SHA256_LANES; j++)
+    {
+        memset(tail[j], 0, nTail);
+        memcpy(tail[j], pin + j * nStride + 64 * nFull, nRest);
+        tail[j][nRest] = 0x80;
+        uint64_t nBits = (uint64_t)nLen << 3;
+        WriteBE32(tail[j] + nTail - 8, nBits >> 32);
+        WriteBE32(tail[j] + nTail - 4, nBits);
+    }
+    for (size_t nOffset = 0; nOffset < nTail; nOffset += 64)
+    {
+        for (int i = 0; i < 16; i++)
+            for (unsigned int j = 0; j < SHA256_LANES; j++)
+                w[i][j] = ReadBE32(tail[j] + nOffset + 4 * i);
+        SHA256Transform(s, w);
+    }
+
+    // The digest words are the first half of the second block
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    for (int i = 8; i < 16; i++)
+        w[i] = w[i] ^ w[i];
+    w[8] += 0x80000000;
+    w[15] += 256;
+    for (int i = 0; i < 8; i++)
+        for (unsigned int j = 0; j < SHA256_LANES; j++)
+            s[i][j] = SHA256_IV[i];
+    SHA256Transform(s, w);
+
+    for (int i = 0; i < 8; i++)
+        for (unsigned int j = 0; j < SHA256_LANES; j++)
+            WriteBE32(pout[j].begin() + 4 * i, s[i][j]);
+}
+
+// Built for the baseline instruction set (SSE2 on x86_64)
+void SHA256DLanesGeneric(const unsigned char* pin, size_t nLen, size_t nStride, uint256* pout)
+{
+    SHA256DLanesBody(pin, nLen, nStride, pout);
+}
+
+#ifdef SHA256_DISPATCH
+__attribute__((target("avx2")))
+void SHA256DLanesAVX2(const unsigned char* pin, size_t nLen, size_t nStride, uint256* pout)
+{
+    SHA256DLanesBody(pin, nLen, nStride, pout);
+}
+
+// AVX-512VL has a rotate and a three-input logic instruction
+__attribute__((target("avx512f,avx512vl")))
+void SHA256DLanesAVX512(const unsigned char* pin, size_t nLen, size_t nStride, uint256* pout)
+{
+    SHA256DLanesBody(pin, nLen, nStride, pout);
+}
+#endif
+#endif
+
+struct CSHA256DKernel
+{
+    SHA256DLanesFn fn;
+    const char* pszName;
+
+    CSHA256DKernel() : fn(SHA256DLanesScalar), pszName("scalar")
+    {
+#ifdef SHA256_VECTOR
+        fn = SHA256DLanesGeneric;
+        pszName = "generic";
+#ifdef SHA256_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512f"))
+        {
+            fn = SHA256DLanesAVX512;
+            pszName = "avx512";
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            fn = SHA256DLanesAVX2;
+            pszName = "avx2";
+        }
+#endif
+#endif
+    }
+};
+
+const CSHA256DKernel& GetSHA256DKernel()
+{
+    static CSHA256DKernel kernel;
+    return kernel;
+}
+
+} // anon namespace
+
+void SHA256DxN(const void* pdata, size_t nLen, unsigned int nCount, uint256* phashes)
+{
+    const CSHA256DKernel& kernel = GetSHA256DKernel();
+    const unsigned char* pbegin = static_cast<const unsigned char*>(pdata);
+    std::vector<unsigned char> vPad;
+    uint256 hashPad[SHA256_LANES];
+
+    for (unsigned int nStart = 0; nStart < nCount; nStart += SHA256_LANES)
+    {
+        unsigned int nLanes = std::min(nCount - nStart, SHA256_LANES);
+        if (nLanes == SHA256_LANES)
+        {
+            kernel.fn(pbegin + nStart * nLen, nLen, nLen, &phashes[nStart]);
+            continue;
+        }
+
+        // Fill the idle lanes of the last group with copies of its first
+        // message; nLen may be zero, so keep at least one byte
+        vPad.assign(std::max(SHA256_LANES * nLen, (size_t)1), 0);
+        for (unsigned int j = 0; j < SHA256_LANES; j++)
+            if (nLen)
+                memcpy(&vPad[j * nLen], pbegin + (nStart + (j < nLanes ? j : 0)) * nLen, nLen);
+        kernel.fn(&vPad[0], nLen, nLen, hashPad);
+        std::copy(hashPad, hashPad + nLanes, &phashes[nStart]);
+    }
+}
+
+const char* SHA256DKernel()
+{
+    return GetSHA256DKernel().pszName;
+}
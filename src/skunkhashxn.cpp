@@ -0,0 +1,400 @@
+// Copyright (c) 2016 The altcommunitycoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+
+#include <algorithm>
+#include <vector>
+
+// Multi-lane SkunkHash5.
+//
+// Cubehash and skein only add, rotate and xor words, so SKUNKHASH5_LANES
+// independent messages are hashed at once with word i of every message in
+// one vector. Cubehash costs the most of the four stages: 176 rounds over a
+// 1 KiB state for a 64-byte message. Skein works on 64-bit words, which only
+// AVX-512 can rotate; on narrower units the lane version is slower than sph,
+// so there skein stays scalar. Fugue and gost are driven by byte-indexed
+// table lookups, and looking those up lane by lane (or with gathers) is
+// slower than the scalar code, so those two stages stay scalar per message.
+
+#if defined(__GNUC__)
+#define SKUNKHASH_VECTOR
+#if defined(__x86_64__) || defined(__i386__)
+#define SKUNKHASH_DISPATCH
+#endif
+#endif
+
+namespace {
+
+typedef void (*CubeHashLanesFn)(const uint32_t* piv, const uint512* pin, uint512* pout);
+typedef void (*SkeinLanesFn)(const uint64_t* piv, const unsigned char* pin, size_t nLen, uint512* pout);
+
+// Reference path: one sph context per message
+void CubeHashLanesScalar(const uint32_t* piv, const uint512* pin, uint512* pout)
+{
+    sph_cubehash512_context ctx;
+    for (unsigned int i = 0; i < SKUNKHASH5_LANES; i++)
+    {
+        sph_cubehash512_init(&ctx);
+        sph_cubehash512(&ctx, static_cast<const void*>(&pin[i]), 64);
+        sph_cubehash512_close(&ctx, static_cast<void*>(&pout[i]));
+    }
+}
+
+// Reference path: skein512 of one nLen-byte message per lane, the messages
+// back to back at pin
+void SkeinLanesScalar(const uint64_t* piv, const unsigned char* pin, size_t nLen, uint512* pout)
+{
+    static unsigned char pblank[1];
+    sph_skein512_context ctx;
+    for (unsigned int i = 0; i < SKUNKHASH5_LANES; i++)
+    {
+        sph_skein512_init(&ctx);
+        sph_skein512(&ctx, nLen ? pin + i * nLen : pblank, nLen);
+        sph_skein512_close(&ctx, static_cast<void*>(&pout[i]));
+    }
+}
+
+#ifdef SKUNKHASH_VECTOR
+typedef uint32_t lanes_t __attribute__((vector_size(4 * SKUNKHASH5_LANES)));
+
+#define LANES_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t ReadLE32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void WriteLE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// One CubeHash round on word i of the state of every lane at once. The
+// specification swaps words between the steps; here the swaps are folded
+// into the indices instead (ia..id are the xor of the pending swap masks of
+// both halves), so after an even and an odd round the words are back in
+// place, the same way sph renames its variables in ROUND_EVEN/ROUND_ODD.
+// The steps are unrolled by hand so that the state stays in registers at -O2.
+#define LANES_UNROLL16(M) M(0) M(1) M(2) M(3) M(4) M(5) M(6) M(7) \
+    M(8) M(9) M(10) M(11) M(12) M(13) M(14) M(15)
+#define LANES_ADD_A(i) x[i + 16] += x[i ^ ia];
+#define LANES_ADD_C(i) x[i + 16] += x[i ^ ic];
+#define LANES_ROTL7(i) x[i] = LANES_ROTL(x[i], 7);
+#define LANES_ROTL11(i) x[i] = LANES_ROTL(x[i], 11);
+#define LANES_XOR_B(i) x[i] ^= x[(i ^ ib) + 16];
+#define LANES_XOR_D(i) x[i] ^= x[(i ^ id) + 16];
+
+static inline __attribute__((always_inline)) void CubeHashRound(lanes_t* x, int ia, int ib, int ic, int id)
+{
+    LANES_UNROLL16(LANES_ADD_A)
+    LANES_UNROLL16(LANES_ROTL7)
+    LANES_UNROLL16(LANES_XOR_B)
+    LANES_UNROLL16(LANES_ADD_C)
+    LANES_UNROLL16(LANES_ROTL11)
+    LANES_UNROLL16(LANES_XOR_D)
+}
+
+static inline __attribute__((always_inline)) void CubeHashRounds(lanes_t* x, int nRounds)
+{
+    for (int r = 0; r < nRounds; r += 2)
+    {
+        CubeHashRound(x, 0, 8, 10, 14);
+        CubeHashRound(x, 15, 7, 5, 1);
+    }
+}
+
+// cubehash512 of one 64-byte message per lane, with the same block split,
+// padding and finalization as sph_cubehash512_close
+static inline __attribute__((always_inline)) void CubeHashLanesBody(const uint32_t* piv, const uint512* pin, uint512* pout)
+{
+    lanes_t x[32];
+    for (int i = 0; i < 32; i++)
+        for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+            x[i][j] = piv[i];
+
+    for (int nBlock = 0; nBlock < 2; nBlock++)
+    {
+        for (int i = 0; i < 8; i++)
+            for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+                x[i][j] ^= ReadLE32((const unsigned char*)&pin[j] + 32 * nBlock + 4 * i);
+        CubeHashRounds(x, 16);
+    }
+
+    x[0] ^= 0x80;
+    CubeHashRounds(x, 16);
+    x[31] ^= 1;
+    CubeHashRounds(x, 160);
+
+    for (int i = 0; i < 16; i++)
+        for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+            WriteLE32(pout[j].begin() + 4 * i, x[i][j]);
+}
+
+// Built for the baseline instruction set (SSE2 on x86_64)
+void CubeHashLanesGeneric(const uint32_t* piv, const uint512* pin, uint512* pout)
+{
+    CubeHashLanesBody(piv, pin, pout);
+}
+
+typedef uint64_t lanes64_t __attribute__((vector_size(8 * SKUNKHASH5_LANES)));
+
+#define LANES_ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t ReadLE64(const unsigned char* p)
+{
+    return (uint64_t)ReadLE32(p) | ((uint64_t)ReadLE32(p + 4) << 32);
+}
+
+static inline void WriteLE64(unsigned char* p, uint64_t x)
+{
+    WriteLE32(p, x);
+    WriteLE32(p + 4, x >> 32);
+}
+
+// Four Threefish-512 rounds with rotation constants r0..r15, words permuted
+// by indexing as in sph's TFBIG_4e/TFBIG_4o
+#define SKEIN_MIX(a, b, r) x[a] += x[b]; x[b] = LANES_ROTL64(x[b], r) ^ x[a];
+#define SKEIN_ROUNDS4(r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15) \
+    SKEIN_MIX(0, 1, r0) SKEIN_MIX(2, 3, r1) SKEIN_MIX(4, 5, r2) SKEIN_MIX(6, 7, r3) \
+    SKEIN_MIX(2, 1, r4) SKEIN_MIX(4, 7, r5) SKEIN_MIX(6, 5, r6) SKEIN_MIX(0, 3, r7) \
+    SKEIN_MIX(4, 1, r8) SKEIN_MIX(6, 3, r9) SKEIN_MIX(0, 5, r10) SKEIN_MIX(2, 7, r11) \
+    SKEIN_MIX(6, 1, r12) SKEIN_MIX(0, 7, r13) SKEIN_MIX(2, 5, r14) SKEIN_MIX(4, 3, r15)
+
+// Adds subkey s of key k and tweak t to the state
+static inline __attribute__((always_inline)) void SkeinInject(lanes64_t* x, const lanes64_t* k, const uint64_t* t, int s)
+{
+    for (int i = 0; i < 8; i++)
+        x[i] += k[(s + i) % 9];
+    x[5] += t[s % 3];
+    x[6] += t[(s + 1) % 3];
+    x[7] += (uint64_t)s;
+}
+
+// One UBI block: h = Threefish-512 of m under key h and tweak (t0, t1),
+// xored with m. The tweak is the same on every lane.
+static inline __attribute__((always_inline)) void SkeinUBI(lanes64_t* h, const lanes64_t* m, uint64_t t0, uint64_t t1)
+{
+    lanes64_t k[9], x[8];
+    uint64_t t[3] = {t0, t1, t0 ^ t1};
+    k[8] = h[0] ^ h[0];
+    k[8] += 0x1BD11BDAA9FC1A22ULL;
+    for (int i = 0; i < 8; i++)
+    {
+        k[i] = h[i];
+        k[8] ^= h[i];
+        x[i] = m[i];
+    }
+    for (int s = 0; s < 18; s += 2)
+    {
+        SkeinInject(x, k, t, s);
+        SKEIN_ROUNDS4(46, 36, 19, 37, 33, 27, 14, 42, 17, 49, 36, 39, 44, 9, 54, 56)
+        SkeinInject(x, k, t, s + 1);
+        SKEIN_ROUNDS4(39, 30, 34, 24, 13, 50, 10, 17, 25, 29, 39, 43, 8, 35, 56, 22)
+    }
+    SkeinInject(x, k, t, 18);
+    for (int i = 0; i < 8; i++)
+        h[i] = x[i] ^ m[i];
+}
+
+// skein512 of one nLen-byte message per lane, with the same block split,
+// tweaks and output block as sph_skein512_close
+static inline __attribute__((always_inline)) void SkeinLanesBody(const uint64_t* piv, const unsigned char* pin, size_t nLen, uint512* pout)
+{
+    static const uint64_t SKEIN_FIRST = 1ULL << 62, SKEIN_FINAL = 1ULL << 63;
+    static const uint64_t SKEIN_TYPE_MSG = 48ULL << 56, SKEIN_TYPE_OUT = 63ULL << 56;
+    lanes64_t h[8], m[8];
+    for (int i = 0; i < 8; i++)
+        for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+            h[i][j] = piv[i];
+
+    // The last block, which may be partial or empty, is zero padded
+    size_t nBlocks = nLen ? (nLen + 63) / 64 : 1;
+    unsigned char block[64];
+    for (size_t nBlock = 0; nBlock < nBlocks; nBlock++)
+    {
+        size_t nEnd = std::min(nLen, 64 * (nBlock + 1));
+        for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+        {
+            memset(block, 0, sizeof(block));
+            memcpy(block, pin + j * nLen + 64 * nBlock, nEnd - 64 * nBlock);
+            for (int i = 0; i < 8; i++)
+                m[i][j] = ReadLE64(block + 8 * i);
+        }
+        SkeinUBI(h, m, nEnd, SKEIN_TYPE_MSG | (nBlock == 0 ? SKEIN_FIRST : 0) | (nBlock + 1 == nBlocks ? SKEIN_FINAL : 0));
+    }
+
+    for (int i = 0; i < 8; i++)
+        m[i] = m[i] ^ m[i];
+    SkeinUBI(h, m, 8, SKEIN_TYPE_OUT | SKEIN_FIRST | SKEIN_FINAL);
+
+    for (int i = 0; i < 8; i++)
+        for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+            WriteLE64(pout[j].begin() + 8 * i, h[i][j]);
+}
+
+#ifdef SKUNKHASH_DISPATCH
+__attribute__((target("avx2")))
+void CubeHashLanesAVX2(const uint32_t* piv, const uint512* pin, uint512* pout)
+{
+    CubeHashLanesBody(piv, pin, pout);
+}
+
+// AVX-512VL keeps all 32 state words in registers and has a rotate
+__attribute__((target("avx512f,avx512vl")))
+void CubeHashLanesAVX512(const uint32_t* piv, const uint512* pin, uint512* pout)
+{
+    CubeHashLanesBody(piv, pin, pout);
+}
+
+__attribute__((target("avx512f,avx512vl")))
+void SkeinLanesAVX512(const uint64_t* piv, const unsigned char* pin, size_t nLen, uint512* pout)
+{
+    SkeinLanesBody(piv, pin, nLen, pout);
+}
+#endif
+#endif
+
+struct CSkunkHashKernel
+{
+    CubeHashLanesFn fnCubeHash;
+    SkeinLanesFn fnSkein;
+    const char* pszName;
+    uint32_t ivCubeHash[32];
+    uint64_t ivSkein[8];
+
+    CSkunkHashKernel() : fnCubeHash(CubeHashLanesScalar), fnSkein(SkeinLanesScalar), pszName("scalar")
+    {
+        sph_cubehash512_context ctx_cubehash;
+        sph_cubehash512_init(&ctx_cubehash);
+        memcpy(ivCubeHash, ctx_cubehash.state, sizeof(ivCubeHash));
+
+        sph_skein512_context ctx_skein;
+        sph_skein512_init(&ctx_skein);
+        uint64_t iv[8] = {ctx_skein.h0, ctx_skein.h1, ctx_skein.h2, ctx_skein.h3,
+                          ctx_skein.h4, ctx_skein.h5, ctx_skein.h6, ctx_skein.h7};
+        memcpy(ivSkein, iv, sizeof(ivSkein));
+
+#ifdef SKUNKHASH_VECTOR
+        fnCubeHash = CubeHashLanesGeneric;
+        pszName = "generic";
+#ifdef SKUNKHASH_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512f"))
+        {
+            fnCubeHash = CubeHashLanesAVX512;
+            fnSkein = SkeinLanesAVX512;
+            pszName = "avx512";
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            fnCubeHash = CubeHashLanesAVX2;
+            pszName = "avx2";
+        }
+#endif
+#endif
+    }
+};
+
+const CSkunkHashKernel& GetSkunkHashKernel()
+{
+    static CSkunkHashKernel kernel;
+    return kernel;
+}
+
+// Runs the stages after skein on nCount skein outputs, a full set of lanes
+// at a time. phash is used as scratch space.
+void SkunkHash5FromSkein(uint512* phash, unsigned int nCount, uint256* phashes)
+{
+    const CSkunkHashKernel& kernel = GetSkunkHashKernel();
+    sph_fugue512_context ctx_fugue;
+    sph_gost512_context ctx_gost;
+    uint512 hashCube[SKUNKHASH5_LANES];
+    uint512 hashPad[SKUNKHASH5_LANES];
+    uint512 hashFugue, hashGost;
+
+    for (unsigned int nStart = 0; nStart < nCount; nStart += SKUNKHASH5_LANES)
+    {
+        unsigned int nLanes = std::min(nCount - nStart, SKUNKHASH5_LANES);
+        const uint512* pin = &phash[nStart];
+        if (nLanes < SKUNKHASH5_LANES)
+        {
+            // Fill the idle lanes of the last group with copies
+            std::copy(pin, pin + nLanes, hashPad);
+            std::fill(hashPad + nLanes, hashPad + SKUNKHASH5_LANES, pin[0]);
+            pin = hashPad;
+        }
+        kernel.fnCubeHash(kernel.ivCubeHash, pin, hashCube);
+
+        for (unsigned int i = 0; i < nLanes; i++)
+        {
+            sph_fugue512_init(&ctx_fugue);
+            sph_fugue512(&ctx_fugue, static_cast<const void*>(&hashCube[i]), 64);
+            sph_fugue512_close(&ctx_fugue, static_cast<void*>(&hashFugue));
+
+            sph_gost512_init(&ctx_gost);
+            sph_gost512(&ctx_gost, static_cast<const void*>(&hashFugue), 64);
+            sph_gost512_close(&ctx_gost, static_cast<void*>(&hashGost));
+
+            phashes[nStart + i] = hashGost.trim256();
+        }
+    }
+}
+
+} // anon namespace
+
+void SkunkHash5xN(const void* pdata, size_t nLen, unsigned int nCount, uint256* phashes)
+{
+    const CSkunkHashKernel& kernel = GetSkunkHashKernel();
+    const unsigned char* pbegin = static_cast<const unsigned char*>(pdata);
+    std::vector<unsigned char> vPad;
+    std::vector<uint512> vHash(nCount);
+    uint512 hashPad[SKUNKHASH5_LANES];
+
+    for (unsigned int nStart = 0; nStart < nCount; nStart += SKUNKHASH5_LANES)
+    {
+        unsigned int nLanes = std::min(nCount - nStart, SKUNKHASH5_LANES);
+        if (nLanes == SKUNKHASH5_LANES)
+        {
+            kernel.fnSkein(kernel.ivSkein, pbegin + nStart * nLen, nLen, &vHash[nStart]);
+            continue;
+        }
+
+        // Fill the idle lanes of the last group with copies of its first
+        // message; nLen may be zero, so keep at least one byte
+        vPad.assign(std::max(SKUNKHASH5_LANES * nLen, (size_t)1), 0);
+        for (unsigned int j = 0; j < SKUNKHASH5_LANES; j++)
+            if (nLen)
+                memcpy(&vPad[j * nLen], pbegin + (nStart + (j < nLanes ? j : 0)) * nLen, nLen);
+        kernel.fnSkein(kernel.ivSkein, &vPad[0], nLen, hashPad);
+        std::copy(hashPad, hashPad + nLanes, &vHash[nStart]);
+    }
+    if (nCount)
+        SkunkHash5FromSkein(&vHash[0], nCount, phashes);
+}
+
+const char* SkunkHash5Kernel()
+{
+    return GetSkunkHashKernel().pszName;
+}
+
+void CSkunkHash5Midstate::HashBatch(unsigned int nNonce, unsigned int nCount, uint256* phashes) const
+{
+    sph_skein512_context ctx_skein;
+    uint512 vHash[SKUNKHASH5_LANES];
+
+    // A group of lanes at a time, so the skein outputs stay in cache
+    for (unsigned int nStart = 0; nStart < nCount; nStart += SKUNKHASH5_LANES)
+    {
+        unsigned int nLanes = std::min(nCount - nStart, SKUNKHASH5_LANES);
+        for (unsigned int i = 0; i < nLanes; i++)
+        {
+            unsigned int n = nNonce + nStart + i;
+            memcpy(&ctx_skein, &this->ctx_skein, sizeof(ctx_skein));
+            sph_skein512(&ctx_skein, &n, sizeof(n));
+            sph_skein512_close(&ctx_skein, static_cast<void*>(&vHash[i]));
+        }
+        SkunkHash5FromSkein(vHash, nLanes, &phashes[nStart]);
+    }
+}
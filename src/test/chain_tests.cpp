@@ -0,0 +1,124 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+BOOST_AUTO_TEST_CASE(chain_set_tip)
+{
+    // A chain of 100 blocks with a fork of 20 blocks off height 70
+    vector<CBlockIndex> vMain(100), vFork(20);
+    for (int i = 0; i < 100; i++)
+    {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = i ? &vMain[i - 1] : NULL;
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        vFork[i].nHeight = 71 + i;
+        vFork[i].pprev = i ? &vFork[i - 1] : &vMain[70];
+    }
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+
+    chain.SetTip(&vMain[99]);
+    BOOST_CHECK(chain.Genesis() == &vMain[0]);
+    BOOST_CHECK(chain.Tip() == &vMain[99]);
+    BOOST_CHECK_EQUAL(chain.Height(), 99);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(chain[i] == &vMain[i]);
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain[100] == NULL);
+    BOOST_CHECK(chain.Next(&vMain[50]) == &vMain[51]);
+    BOOST_CHECK(chain.Next(&vMain[99]) == NULL);
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+
+    // Switching to the fork replaces the blocks above the fork point only
+    chain.SetTip(&vFork[19]);
+    BOOST_CHECK_EQUAL(chain.Height(), 90);
+    BOOST_CHECK(chain[70] == &vMain[70]);
+    BOOST_CHECK(chain[71] == &vFork[0]);
+    BOOST_CHECK(chain.Tip() == &vFork[19]);
+    BOOST_CHECK(!chain.Contains(&vMain[71]));
+    BOOST_CHECK(chain.Next(&vMain[71]) == NULL);
+
+    // And back to a shorter part of the main chain
+    chain.SetTip(&vMain[80]);
+    BOOST_CHECK_EQUAL(chain.Height(), 80);
+    BOOST_CHECK(chain[75] == &vMain[75]);
+    BOOST_CHECK(chain[81] == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(block_index_arena)
+{
+    // Entries from the arena are distinct, usable and indexed by hash
+    BlockMap mapIndex;
+    size_t nBytesBefore = GetBlockIndexArenaBytes();
+    vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 5000; i++)
+    {
+        CBlockIndex* pindex = new (AllocBlockIndex()) CBlockIndex();
+        pindex->nHeight = i;
+        pindex->pprev = i ? vIndex.back() : NULL;
+        BlockMap::iterator mi = mapIndex.insert(make_pair(uint256(i + 1), pindex)).first;
+        pindex->phashBlock = &mi->first;
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK(GetBlockIndexArenaBytes() >= nBytesBefore + 5000 * sizeof(CBlockIndex));
+    BOOST_CHECK_EQUAL(mapIndex.size(), 5000U);
+    for (int i = 0; i < 5000; i++)
+    {
+        BlockMap::iterator mi = mapIndex.find(uint256(i + 1));
+        BOOST_CHECK(mi != mapIndex.end() && mi->second == vIndex[i]);
+        BOOST_CHECK(vIndex[i]->GetBlockHash() == uint256(i + 1));
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+    }
+    BOOST_CHECK(mapIndex.find(uint256(0)) == mapIndex.end());
+}
+
+BOOST_AUTO_TEST_CASE(disk_block_index_hash)
+{
+    // A block old enough for -fastindex to use the stored hash, with no
+    // parent since the entry takes hashPrev from pprev
+    CBlock block;
+    block.hashMerkleRoot = uint256(2);
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 3;
+    uint256 hash = block.GetHash();
+    CBlockIndex index(1, 0, block);
+    string strHash(BEGIN(hash), END(hash));
+
+    bool fUseFastIndexSaved = fUseFastIndex;
+    fUseFastIndex = true;
+
+    // Entries are written with the block hash as their last field
+    index.phashBlock = &hash;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CDiskBlockIndex(&index);
+    string strIndex = ss.str();
+    BOOST_CHECK(strIndex.substr(strIndex.size() - 32) == strHash);
+    CDiskBlockIndex diskindex;
+    ss >> diskindex;
+    BOOST_CHECK(diskindex.GetBlockHash() == hash);
+
+    // Entries from before that carry a zero hash in the same place, and the
+    // hash is computed from the header when they are read
+    index.phashBlock = NULL;
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << CDiskBlockIndex(&index);
+    string strIndexOld = ssOld.str();
+    BOOST_CHECK_EQUAL(strIndexOld.size(), strIndex.size());
+    BOOST_CHECK(strIndexOld.substr(strIndexOld.size() - 32) == string(32, '\0'));
+    CDiskBlockIndex diskindexOld;
+    ssOld >> diskindexOld;
+    BOOST_CHECK(diskindexOld.GetBlockHash() == hash);
+
+    fUseFastIndex = fUseFastIndexSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
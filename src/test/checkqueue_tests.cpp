@@ -0,0 +1,144 @@
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// Helpers:
+static std::vector<unsigned char>
+Serialize(const CScript& s)
+{
+    std::vector<unsigned char> sSerialized(s);
+    return sSerialized;
+}
+
+static const unsigned int nCheckFlags = SCRIPT_VERIFY_NOCACHE | MANDATORY_SCRIPT_VERIFY_FLAGS;
+
+// Runs the checks of all inputs of tx one after the other
+static bool CheckSequential(const CTransaction& txFrom, const CTransaction& tx)
+{
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        CScriptCheck check(txFrom.vout[tx.vin[i].prevout.n].scriptPubKey, tx, i, nCheckFlags, 0);
+        if (!check())
+            return false;
+    }
+    return true;
+}
+
+// Runs the same checks through the queue, the way ConnectBlock does
+static bool CheckParallel(CCheckQueue<CScriptCheck>& queue, const CTransaction& txFrom, const vector<CTransaction>& vtx)
+{
+    CCheckQueueControl<CScriptCheck> control(&queue);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        vector<CScriptCheck> vChecks;
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            vChecks.push_back(CScriptCheck(txFrom.vout[tx.vin[i].prevout.n].scriptPubKey, tx, i, nCheckFlags, 0));
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(script_checks_parallel_match_sequential)
+{
+    CBasicKeyStore keystore;
+    vector<CPubKey> keys;
+    for (int i = 0; i < 3; i++)
+    {
+        CKey k;
+        k.MakeNewKey(true);
+        keystore.AddKey(k);
+        keys.push_back(k.GetPubKey());
+    }
+
+    // The scripts of sigopcount_tests: bare and pay-to-script-hash multisig,
+    // plus the plain pay-to-pubkey(-hash) forms.
+    CScript s2;
+    s2.SetMultisig(1, keys);
+    keystore.AddCScript(s2);
+    CScript p2sh;
+    p2sh.SetDestination(s2.GetID());
+
+    CTransaction txFrom;
+    txFrom.vout.resize(4);
+    txFrom.vout[0].scriptPubKey.SetDestination(keys[0].GetID());
+    txFrom.vout[1].scriptPubKey << keys[1] << OP_CHECKSIG;
+    txFrom.vout[2].scriptPubKey = s2;
+    txFrom.vout[3].scriptPubKey = p2sh;
+    for (unsigned int i = 0; i < txFrom.vout.size(); i++)
+        txFrom.vout[i].nValue = COIN;
+
+    CTransaction txTo;
+    txTo.vin.resize(4);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 4 * COIN;
+    txTo.vout[0].scriptPubKey.SetDestination(keys[2].GetID());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i));
+    }
+
+    // Changing an output after signing invalidates every signature
+    CTransaction txBadAll = txTo;
+    txBadAll.vout[0].nValue++;
+
+    // A pay-to-script-hash input whose redeem script does not match
+    CTransaction txBadP2SH = txTo;
+    CScript scriptSigBad;
+    scriptSigBad << OP_0 << Serialize(txFrom.vout[1].scriptPubKey);
+    txBadP2SH.vin[3].scriptSig = scriptSigBad;
+
+    // A bare multisig spend without the extra dummy element
+    CTransaction txBadMultisig = txTo;
+    CScript scriptSigMultisig;
+    CScript::const_iterator pc = txTo.vin[2].scriptSig.begin();
+    opcodetype opcode;
+    vector<unsigned char> vchDummy, vchSig;
+    BOOST_CHECK(txTo.vin[2].scriptSig.GetOp(pc, opcode, vchDummy));
+    BOOST_CHECK(txTo.vin[2].scriptSig.GetOp(pc, opcode, vchSig));
+    scriptSigMultisig << vchSig;
+    txBadMultisig.vin[2].scriptSig = scriptSigMultisig;
+
+    boost::thread_group threadGroup;
+    CCheckQueue<CScriptCheck> queue(128);
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    vector<CTransaction> vCases;
+    vCases.push_back(txTo);
+    vCases.push_back(txBadAll);
+    vCases.push_back(txBadP2SH);
+    vCases.push_back(txBadMultisig);
+    BOOST_CHECK(CheckSequential(txFrom, txTo));
+    BOOST_CHECK(!CheckSequential(txFrom, txBadAll));
+    BOOST_CHECK(!CheckSequential(txFrom, txBadP2SH));
+    BOOST_CHECK(!CheckSequential(txFrom, txBadMultisig));
+    BOOST_FOREACH(const CTransaction& tx, vCases)
+        BOOST_CHECK_EQUAL(CheckParallel(queue, txFrom, vector<CTransaction>(1, tx)), CheckSequential(txFrom, tx));
+
+    // Enough work to be spread over all workers, with and without a single
+    // bad transaction in the middle
+    vector<CTransaction> vBlock(100, txTo);
+    BOOST_CHECK(CheckParallel(queue, txFrom, vBlock));
+    vBlock[50] = txBadP2SH;
+    BOOST_CHECK(!CheckParallel(queue, txFrom, vBlock));
+    vBlock[50] = txTo;
+    BOOST_CHECK(CheckParallel(queue, txFrom, vBlock));
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
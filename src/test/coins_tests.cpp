@@ -0,0 +1,98 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coin_from_transaction)
+{
+    CTransaction txStake;
+    txStake.nTime = 1400000000;
+    txStake.vin.push_back(CTxIn(COutPoint(uint256(1), 0)));
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = 1000 * COIN;
+    txStake.vout[1].scriptPubKey << OP_TRUE;
+    BOOST_CHECK(txStake.IsCoinStake());
+
+    CDiskTxPos pos(1, 1000, 1090);
+    CCoin coin(txStake, 1, pos, 12345, 1400000016);
+    BOOST_CHECK(!coin.IsNull());
+    BOOST_CHECK(coin.IsCoinStake());
+    BOOST_CHECK(!coin.IsCoinBase());
+    BOOST_CHECK(coin.txout == txStake.vout[1]);
+    BOOST_CHECK_EQUAL(coin.nTime, txStake.nTime);
+    BOOST_CHECK_EQUAL(coin.nBlockTime, 1400000016U);
+    BOOST_CHECK_EQUAL(coin.nHeight, 12345);
+    BOOST_CHECK_EQUAL(coin.GetTxOffset(), 90U);
+
+    CTransaction txBase;
+    txBase.vin.push_back(CTxIn());
+    txBase.vout.resize(1);
+    txBase.vout[0].nValue = 50 * COIN;
+    BOOST_CHECK(txBase.IsCoinBase());
+    CCoin coinBase(txBase, 0, pos, 1, 0);
+    BOOST_CHECK(coinBase.IsCoinBase());
+    BOOST_CHECK(!coinBase.IsCoinStake());
+
+    coin.SetNull();
+    BOOST_CHECK(coin.IsNull());
+}
+
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    CTransaction tx;
+    tx.nTime = 1400000000;
+    tx.vin.push_back(CTxIn(COutPoint(uint256(2), 3)));
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 123456789;
+    tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    CCoin coin(tx, 0, CDiskTxPos(3, 400, 480), 250000, 1400000032);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coin;
+    // The pay-to-pubkey-hash script is stored compressed
+    BOOST_CHECK(ss.size() < 64);
+
+    CCoin coin2;
+    ss >> coin2;
+    BOOST_CHECK(coin2.txout == coin.txout);
+    BOOST_CHECK(coin2.pos == coin.pos);
+    BOOST_CHECK_EQUAL(coin2.nHeight, coin.nHeight);
+    BOOST_CHECK_EQUAL(coin2.nTime, coin.nTime);
+    BOOST_CHECK_EQUAL(coin2.nBlockTime, coin.nBlockTime);
+    BOOST_CHECK_EQUAL(coin2.nFlags, coin.nFlags);
+}
+
+BOOST_AUTO_TEST_CASE(block_undo_serialization)
+{
+    CTransaction tx;
+    tx.nTime = 1400000000;
+    tx.vin.push_back(CTxIn(COutPoint(uint256(4), 0)));
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    tx.vout[1].nValue = 7 * COIN;
+    tx.vout[1].scriptPubKey << OP_FALSE;
+
+    CBlockUndo undo;
+    undo.vSpent.push_back(CCoin(tx, 1, CDiskTxPos(2, 100, 180), 1000, 1400000016));
+    undo.vSpent.push_back(CCoin(tx, 0, CDiskTxPos(2, 100, 180), 1000, 1400000016));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << undo;
+    CBlockUndo undo2;
+    ss >> undo2;
+
+    // The coins come back in the order they were spent
+    BOOST_CHECK_EQUAL(undo2.vSpent.size(), 2U);
+    BOOST_CHECK(undo2.vSpent[0].txout == tx.vout[1]);
+    BOOST_CHECK(undo2.vSpent[1].txout == tx.vout[0]);
+    BOOST_CHECK(undo2.vSpent[1].pos == CDiskTxPos(2, 100, 180));
+    BOOST_CHECK_EQUAL(undo2.vSpent[1].nHeight, 1000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,147 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "main.h"
+#include "kernel.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hash_tests)
+
+BOOST_AUTO_TEST_CASE(skunkhash5_midstate)
+{
+    CBlock block;
+    block.nVersion = 6;
+    block.hashPrevBlock = Hash(BEGIN(block.nVersion), END(block.nVersion));
+    block.hashMerkleRoot = ~block.hashPrevBlock;
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+
+    CSkunkHash5Midstate midstate;
+    midstate.Init(BEGIN(block.nVersion));
+    for (block.nNonce = 0; block.nNonce < 100; block.nNonce++)
+        BOOST_CHECK(midstate.Hash(block.nNonce) == block.GetPoWHash());
+
+    // Nonces near the top of the range
+    for (block.nNonce = 0xfffffff0; block.nNonce != 0; block.nNonce++)
+        BOOST_CHECK(midstate.Hash(block.nNonce) == block.GetPoWHash());
+
+    uint256 vHashes[64];
+    midstate.HashBatch(1000, 64, vHashes);
+    for (unsigned int i = 0; i < 64; i++)
+    {
+        block.nNonce = 1000 + i;
+        BOOST_CHECK(vHashes[i] == block.GetPoWHash());
+    }
+
+    // The midstate has to be rebuilt when the prefix changes
+    block.nTime++;
+    block.nNonce = 0;
+    BOOST_CHECK(midstate.Hash(0) != block.GetPoWHash());
+    midstate.Init(BEGIN(block.nVersion));
+    BOOST_CHECK(midstate.Hash(0) == block.GetPoWHash());
+}
+
+BOOST_AUTO_TEST_CASE(skunkhash5_lanes)
+{
+    // Headers of distinct blocks, as a batch of headers to validate
+    vector<CBlock> vBlocks(2 * SKUNKHASH5_LANES + 3);
+    vector<unsigned char> vHeaders;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        CBlock& block = vBlocks[i];
+        block.nVersion = 6;
+        block.hashPrevBlock = Hash(BEGIN(i), END(i));
+        block.hashMerkleRoot = ~block.hashPrevBlock;
+        block.nTime = 1400000000 + i;
+        block.nBits = 0x1e0fffff;
+        block.nNonce = i * 7919;
+        vHeaders.insert(vHeaders.end(), BEGIN(block.nVersion), END(block.nNonce));
+    }
+
+    // Every batch size up to a few full sets of lanes
+    vector<uint256> vHashes(vBlocks.size());
+    for (unsigned int nCount = 1; nCount <= vBlocks.size(); nCount++)
+    {
+        SkunkHash5xN(&vHeaders[0], 80, nCount, &vHashes[0]);
+        for (unsigned int i = 0; i < nCount; i++)
+            BOOST_CHECK(vHashes[i] == vBlocks[i].GetPoWHash());
+    }
+
+    // Other message lengths, around the skein block size
+    size_t vLen[] = {0, 1, 33, 63, 64, 65, 128, 129};
+    for (unsigned int l = 0; l < sizeof(vLen) / sizeof(vLen[0]); l++)
+    {
+        size_t nLen = vLen[l];
+        unsigned int nCount = min(vHeaders.size() / max(nLen, (size_t)1), vHashes.size());
+        SkunkHash5xN(&vHeaders[0], nLen, nCount, &vHashes[0]);
+        for (unsigned int i = 0; i < nCount; i++)
+            BOOST_CHECK(vHashes[i] == SkunkHash5(vHeaders.begin() + nLen * i, vHeaders.begin() + nLen * (i + 1)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256d_lanes)
+{
+    vector<unsigned char> vData(200 * (2 * SHA256_LANES + 3));
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = i * 131 + 7;
+
+    // Lengths around the block and padding boundaries, including the sizes
+    // of a stake kernel, and every batch size up to a few sets of lanes
+    size_t vLen[] = {0, 1, 32, 55, 56, 63, 64, 76, 119, 120, 200};
+    vector<uint256> vHashes(2 * SHA256_LANES + 3);
+    for (unsigned int l = 0; l < sizeof(vLen) / sizeof(vLen[0]); l++)
+    {
+        size_t nLen = vLen[l];
+        for (unsigned int nCount = 1; nCount <= vHashes.size(); nCount++)
+        {
+            SHA256DxN(&vData[0], nLen, nCount, &vHashes[0]);
+            for (unsigned int i = 0; i < nCount; i++)
+                BOOST_CHECK(vHashes[i] == Hash(vData.begin() + nLen * i, vData.begin() + nLen * (i + 1)));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_serialization)
+{
+    CBlockIndex index;
+    index.nStakeModifier = 0x0123456789abcdefULL;
+    index.bnStakeModifierV2 = uint256("0x00112233445566778899aabbccddeeff0123456789abcdeffedcba9876543210");
+
+    CStakeKernelInput input;
+    input.prevout = COutPoint(uint256("0xfedcba98765432100123456789abcdefffeeddccbbaa99887766554433221100"), 0x81020304);
+    input.nTimeTxPrev = 0x40506070;
+    input.nTimeBlockFrom = 0x90a0b0c0;
+
+    // One timestamp before protocol v3 and one after it
+    unsigned int vTime[] = {1400000000, 1480000000};
+    for (unsigned int t = 0; t < 2; t++)
+    {
+        unsigned int nTime = vTime[t];
+        CDataStream ss(SER_GETHASH, 0);
+        if (IsProtocolV3(nTime))
+            ss << index.bnStakeModifierV2;
+        else
+            ss << index.nStakeModifier << input.nTimeBlockFrom;
+        ss << input.nTimeTxPrev << input.prevout.hash << input.prevout.n << nTime;
+
+        unsigned char pch[STAKE_KERNEL_SIZE_V3];
+        size_t nSize = WriteStakeKernel(pch, &index, input, nTime);
+        BOOST_CHECK_EQUAL(nSize, IsProtocolV3(nTime) ? STAKE_KERNEL_SIZE_V3 : STAKE_KERNEL_SIZE_V2);
+        BOOST_CHECK(nSize == ss.size() && memcmp(pch, &ss[0], nSize) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(siphash_uint256)
+{
+    // The 32-byte SipHash-2-4 reference vector: key 00..0f, message 00..1f
+    uint256 val("0x1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+
+    // mapBlockIndex hashes depend on all of the block hash, not only its low bits
+    uint256 valHigh = val;
+    *(valHigh.end() - 1) ^= 1;
+    BOOST_CHECK(BlockHasher()(valHigh) != BlockHasher()(val));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(script_tests)
+
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = COIN;
+    BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+
+    const CScript& scriptPubKey = txFrom.vout[0].scriptPubKey;
+    CSignatureCacheStats before, after;
+
+    // A check with SCRIPT_VERIFY_NOCACHE queries the cache but leaves it alone
+    GetSignatureCacheStats(before);
+    BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NOCACHE, 0));
+    GetSignatureCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses + 1);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts);
+
+    // The first cached check misses and stores the signature
+    GetSignatureCacheStats(before);
+    BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+    GetSignatureCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses + 1);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts + 1);
+
+    // Later checks of the same signature are hits, also at block connect
+    GetSignatureCacheStats(before);
+    BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NOCACHE, 0));
+    GetSignatureCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits + 1);
+    BOOST_CHECK_EQUAL(after.nMisses, before.nMisses);
+
+    // A different transaction is not found in the cache
+    txTo.vout[0].nValue--;
+    GetSignatureCacheStats(before);
+    BOOST_CHECK(!VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+    GetSignatureCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits);
+
+    // The table has a fixed size
+    BOOST_CHECK(after.nBytes <= ((uint64_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20));
+    BOOST_CHECK(after.nEntries <= after.nCapacity);
+}
+
+BOOST_AUTO_TEST_CASE(script_sigcache_size)
+{
+    CSignatureCacheStats stats;
+
+    // -maxsigcachesize still counts entries
+    mapArgs["-maxsigcachesize"] = "50000";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK(stats.nBytes > 0);
+    BOOST_CHECK(stats.nBytes <= 50000 * 32);
+
+    // and 0 still disables the cache
+    mapArgs["-maxsigcachesize"] = "0";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 0U);
+
+    // -sigcachemib wins over it
+    mapArgs["-sigcachemib"] = "1";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK(stats.nBytes > 0);
+    BOOST_CHECK(stats.nBytes <= (1 << 20));
+
+    mapArgs["-sigcachemib"] = "0";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 0U);
+
+    mapArgs.erase("-sigcachemib");
+    mapArgs.erase("-maxsigcachesize");
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK(stats.nBytes > (1 << 20));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -42,4 +42,27 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(span_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    vector<string> vIn;
+    vIn.push_back("first");
+    vIn.push_back(string(1000, 'x'));
+    ss << vIn << 12345;
+    vector<char> vData(ss.begin(), ss.end());
+
+    // Reads the same objects out of the span as the stream they came from
+    CSpanReader span(&vData[0], &vData[0] + vData.size(), SER_DISK, 0);
+    vector<string> vOut;
+    int n;
+    span >> vOut >> n;
+    BOOST_CHECK(vOut == vIn);
+    BOOST_CHECK_EQUAL(n, 12345);
+    BOOST_CHECK(span.empty());
+
+    // An object cut short by the end of the span throws
+    CSpanReader spanShort(&vData[0], &vData[0] + vData.size() - 5, SER_DISK, 0);
+    BOOST_CHECK_THROW(spanShort >> vOut >> n, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
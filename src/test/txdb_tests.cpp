@@ -0,0 +1,126 @@
+#include <boost/test/unit_test.hpp>
+
+#include "txdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(batch_lookup)
+{
+    CTxDBBatch batch;
+    string strValue = "untouched";
+    bool fErased = false;
+
+    BOOST_CHECK(!batch.Lookup("a", &strValue, &fErased));
+
+    batch.Put("a", "1");
+    BOOST_CHECK(batch.Lookup("a", &strValue, &fErased));
+    BOOST_CHECK(!fErased);
+    BOOST_CHECK_EQUAL(strValue, "1");
+
+    // Only the last change to a key counts
+    batch.Put("a", "2");
+    batch.Delete("b");
+    BOOST_CHECK_EQUAL(batch.size(), 2U);
+    BOOST_CHECK(batch.Lookup("a", &strValue, &fErased));
+    BOOST_CHECK_EQUAL(strValue, "2");
+
+    strValue = "untouched";
+    BOOST_CHECK(batch.Lookup("b", &strValue, &fErased));
+    BOOST_CHECK(fErased);
+    BOOST_CHECK_EQUAL(strValue, "untouched");
+
+    batch.Delete("a");
+    BOOST_CHECK(batch.Lookup("a", &strValue, &fErased));
+    BOOST_CHECK(fErased);
+
+    batch.Put("b", "3");
+    BOOST_CHECK(batch.Lookup("b", &strValue, &fErased));
+    BOOST_CHECK(!fErased);
+    BOOST_CHECK_EQUAL(strValue, "3");
+}
+
+BOOST_AUTO_TEST_CASE(cache_eviction)
+{
+    // Room for 100 clean entries of 200 bytes
+    CTxDBCache cache;
+    cache.SetBudget(100 * 200);
+    string strValue(200 - 4 - TXDB_CACHE_ENTRY_OVERHEAD, 'v');
+    for (int i = 0; i < 150; i++)
+    {
+        string strKey = strprintf("k%03d", i), strRead;
+        unsigned int nGeneration = 0;
+        BOOST_CHECK(cache.Get(strKey, &strRead, nGeneration) == CTxDBCache::CACHE_MISS);
+        cache.AddClean(strKey, strValue, nGeneration);
+    }
+
+    // The 50 entries evicted are not simply the lowest keys
+    int nFirstKept = 0, nLaterEvicted = 0;
+    for (int i = 0; i < 150; i++)
+    {
+        string strRead;
+        unsigned int nGeneration;
+        bool fFound = cache.Get(strprintf("k%03d", i), &strRead, nGeneration) == CTxDBCache::CACHE_FOUND;
+        if (i < 50 && fFound)
+            nFirstKept++;
+        if (i >= 50 && !fFound)
+            nLaterEvicted++;
+    }
+    BOOST_CHECK_EQUAL(nFirstKept, nLaterEvicted);
+    BOOST_CHECK(nLaterEvicted > 0);
+}
+
+BOOST_AUTO_TEST_CASE(key_encoding)
+{
+    // Keys come out the same as from a CDataStream
+    uint256 hash = GetRandHash();
+    CTxDBKey key(make_pair(string("tx"), hash));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair(string("tx"), hash);
+    BOOST_CHECK_EQUAL(key.GetSlice().ToString(), ss.str());
+
+    CTxDBKey keyVersion(string("version"));
+    BOOST_CHECK_EQUAL(keyVersion.size(), 8U);
+
+    // and longer ones than the buffer holds are refused
+    BOOST_CHECK_THROW(CTxDBKey(string(TXDB_MAX_KEY_SIZE, 'x')), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(txindex_serialization)
+{
+    CTxIndex txindex(CDiskTxPos(3, 1000000, 1000181), 20);
+    txindex.vSpent[0] = CDiskTxPos(4, 500, 600);
+    txindex.vSpent[9] = CDiskTxPos(4, 500, 900);
+    txindex.vSpent[19] = CTxIndex::SpentPosUnread();
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txindex;
+    // The position as varints (1 + 3 + 2 bytes), the output count and a
+    // bitmap of three bytes instead of a version, the position and the
+    // location of every spend
+    BOOST_CHECK_EQUAL(ss.size(), 6U + 1U + 3U);
+    BOOST_CHECK(ss.size() < 4U + 12U + 1U + 12U * 20U);
+
+    CTxIndex txindex2;
+    ss >> txindex2;
+    BOOST_CHECK(txindex2.pos == txindex.pos);
+    BOOST_CHECK_EQUAL(txindex2.vSpent.size(), 20U);
+    for (unsigned int n = 0; n < 20; n++)
+    {
+        // Where the outputs were spent is not part of the record
+        if (n == 0 || n == 9 || n == 19)
+            BOOST_CHECK(txindex2.vSpent[n] == CTxIndex::SpentPosUnread());
+        else
+            BOOST_CHECK(txindex2.vSpent[n].IsNull());
+    }
+
+    CDiskTxPos pos(5, 123456, 123789), pos2;
+    CDataStream ssPos(SER_DISK, CLIENT_VERSION);
+    ssPos << CDiskTxPosCompressor(pos);
+    CDiskTxPosCompressor compressor(pos2);
+    ssPos >> compressor;
+    BOOST_CHECK(pos2 == pos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
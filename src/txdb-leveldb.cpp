@@ -6,8 +6,10 @@
 #include <map>
 
 #include <boost/version.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -25,11 +27,167 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Held while txdb is opened, replaced on an upgrade or closed, and by the
+// static functions that use it outside of a CTxDB instance
+static CCriticalSection cs_txdb;
+
+// One operation that reached the LevelDB, as written by -dbrecord and
+// replayed by -dbbench
+class CTxDBRecord
+{
+public:
+    enum
+    {
+        RECORD_GET = 'g',
+        RECORD_PUT = 'p',
+        RECORD_DELETE = 'd',
+        RECORD_COMMIT = 'c',
+    };
+
+    unsigned char nOp;
+    std::string strKey;
+    std::string strValue;
+    bool fFound;
+
+    CTxDBRecord() : nOp(0), fFound(false) {}
+    CTxDBRecord(unsigned char nOpIn, const std::string& strKeyIn = std::string(), const std::string& strValueIn = std::string(), bool fFoundIn = false) :
+        nOp(nOpIn), strKey(strKeyIn), strValue(strValueIn), fFound(fFoundIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nOp);
+        if (nOp != RECORD_COMMIT)
+            READWRITE(strKey);
+        if (nOp == RECORD_GET)
+            READWRITE(fFound);
+        if ((nOp == RECORD_GET && fFound) || nOp == RECORD_PUT)
+            READWRITE(strValue);
+    )
+};
+
+// Appends the reads that miss the write-back cache and the batches it writes
+// out to the -dbrecord file, to be replayed later with other settings
+class CTxDBRecorder
+{
+private:
+    CCriticalSection cs_record;
+    FILE* file;
+
+public:
+    CTxDBRecorder() : file(NULL) {}
+
+    bool Open(const boost::filesystem::path& path)
+    {
+        LOCK(cs_record);
+        if (file)
+            return true;
+        file = fopen(path.string().c_str(), "wb");
+        if (!file)
+            return error("CTxDBRecorder::Open() : cannot create %s", path.string());
+        LogPrintf("Recording txdb workload to %s\n", path.string());
+        return true;
+    }
+
+    void Close()
+    {
+        LOCK(cs_record);
+        if (file)
+            fclose(file);
+        file = NULL;
+    }
+
+    bool IsOpen()
+    {
+        LOCK(cs_record);
+        return file != NULL;
+    }
+
+    void Add(const CTxDBRecord& record)
+    {
+        LOCK(cs_record);
+        if (!file)
+            return;
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << record;
+        if (fwrite(&ss[0], 1, ss.size(), file) != ss.size())
+        {
+            LogPrintf("CTxDBRecorder::Add() : write failed, recording stopped\n");
+            fclose(file);
+            file = NULL;
+        }
+    }
+};
+
+static CTxDBRecorder txdbRecorder;
+
+bool CTxDBCache::Flush(leveldb::DB *pdb)
+{
+    LOCK(cs_cache);
+    if (mapDirty.empty())
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    leveldb::WriteBatch batch;
+    for (DirtyMap::const_iterator mi = mapDirty.begin(); mi != mapDirty.end(); ++mi)
+    {
+        if ((*mi).second.fErased)
+            batch.Delete((*mi).first);
+        else
+            batch.Put((*mi).first, (*mi).second.strValue);
+    }
+    if (txdbRecorder.IsOpen())
+    {
+        for (DirtyMap::const_iterator mi = mapDirty.begin(); mi != mapDirty.end(); ++mi)
+        {
+            if ((*mi).second.fErased)
+                txdbRecorder.Add(CTxDBRecord(CTxDBRecord::RECORD_DELETE, (*mi).first));
+            else
+                txdbRecorder.Add(CTxDBRecord(CTxDBRecord::RECORD_PUT, (*mi).first, (*mi).second.strValue));
+        }
+        txdbRecorder.Add(CTxDBRecord(CTxDBRecord::RECORD_COMMIT));
+    }
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = fSync;
+    leveldb::Status status = pdb->Write(writeOptions, &batch);
+    if (!status.ok())
+        return error("CTxDBCache::Flush() : LevelDB batch write failure: %s", status.ToString());
+
+    LogPrint("db", "Flushed %u txdb entries (%.1f MiB) in %dms\n",
+        mapDirty.size(), nDirtyBytes / 1048576.0, GetTimeMillis() - nStart);
+
+    // The written entries stay around as clean ones
+    nGeneration++;
+    DirtyMap mapWritten;
+    mapWritten.swap(mapDirty);
+    nDirtyBytes = 0;
+    for (DirtyMap::const_iterator mi = mapWritten.begin(); mi != mapWritten.end(); ++mi)
+        if (!(*mi).second.fErased)
+            InsertClean((*mi).first, (*mi).second.strValue);
+    return true;
+}
+
+static CTxDBCache txdbCache;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    // A quarter of -dbcache goes to the LevelDB block cache, the rest to the
+    // write-back cache in front of it
+    int64_t nCacheSize = GetArg("-dbcache", 100) * 1048576;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 4);
+    txdbCache.SetBudget(nCacheSize - nCacheSize / 4);
+    txdbCache.SetSync(GetBoolArg("-dbsync", true));
+
+    options.write_buffer_size = std::max((int64_t)1, GetArg("-dbwritebuffer", DEFAULT_DB_WRITE_BUFFER)) * 1048576;
+    options.max_open_files = std::max((int64_t)20, GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES));
+    options.block_size = std::max((int64_t)1, GetArg("-dbblocksize", DEFAULT_DB_BLOCK_SIZE)) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    int nBloomBits = GetArg("-dbbloombits", DEFAULT_DB_BLOOM_BITS);
+    options.filter_policy = nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(nBloomBits) : NULL;
+
+    LogPrint("db", "LevelDB options: cache %dMiB, write buffer %dKiB, max open files %d, block size %dB, compression %d, bloom bits %d, sync %d\n",
+        nCacheSize / 1048576, options.write_buffer_size / 1024, options.max_open_files, options.block_size,
+        options.compression == leveldb::kSnappyCompression, nBloomBits, GetBoolArg("-dbsync", true));
     return options;
 }
 
@@ -38,6 +196,7 @@ static void init_blockindex(leveldb::Options& options, bool fRemoveOld = false,
     filesystem::path directory = GetDataDir() / "txleveldb";
 
     if (fRemoveOld) {
+        txdbCache.Clear();
         filesystem::remove_all(directory); // remove directory
         unsigned int nFile = 1;
         filesystem::path bootstrap = GetDataDir() / "bootstrap.dat";
@@ -76,6 +235,7 @@ CTxDB::CTxDB(const char* pszMode)
     activeBatch = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
+    LOCK(cs_txdb);
     if (txdb) {
         pdb = txdb;
         return;
@@ -85,11 +245,13 @@ CTxDB::CTxDB(const char* pszMode)
 
     options = GetOptions();
     options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
 
     init_blockindex(options); // Init directory
     pdb = txdb;
 
+    if (mapArgs.count("-dbrecord"))
+        txdbRecorder.Open(GetArg("-dbrecord", ""));
+
     if (Exists(string("version")))
     {
         ReadVersion(nVersion);
@@ -127,6 +289,10 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    LOCK(cs_txdb);
+    Flush();
+    txdbCache.Clear();
+    txdbRecorder.Close();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -137,68 +303,338 @@ void CTxDB::Close()
     activeBatch = NULL;
 }
 
+bool CTxDB::Flush()
+{
+    LOCK(cs_txdb);
+    if (!txdb)
+        return true;
+    return txdbCache.Flush(txdb);
+}
+
+// Background compactions are held back until nCompactionDeferredUntil
+static CCriticalSection cs_compaction;
+static int64_t nCompactionDeferredUntil = 0;
+static bool fCompactionDeferred = false;
+
+void CTxDB::DeferCompaction(int64_t nSeconds)
+{
+    if (!GetBoolArg("-dbdefercompaction", true))
+        return;
+    LOCK(cs_compaction);
+    nCompactionDeferredUntil = std::max(nCompactionDeferredUntil, GetTime() + nSeconds);
+    if (!fCompactionDeferred && txdb)
+    {
+        txdb->SetCompactionDeferred(true);
+        fCompactionDeferred = true;
+        LogPrint("db", "Deferring LevelDB compactions\n");
+    }
+}
+
+bool CTxDB::ResumeCompaction(bool fForce)
+{
+    LOCK(cs_compaction);
+    if (fCompactionDeferred && (fForce || GetTime() >= nCompactionDeferredUntil))
+    {
+        if (txdb)
+            txdb->SetCompactionDeferred(false);
+        fCompactionDeferred = false;
+        nCompactionDeferredUntil = 0;
+        LogPrint("db", "Resuming LevelDB compactions\n");
+    }
+    return !fCompactionDeferred;
+}
+
+bool CTxDB::Compact()
+{
+    if (!txdb)
+        return false;
+    ResumeCompaction(true);
+    LogPrintf("Compacting the block database\n");
+    int64_t nStart = GetTimeMillis();
+    txdb->CompactRange(NULL, NULL);
+    LogPrintf("Compacted the block database in %dms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new CTxDBBatch();
     return true;
 }
 
+// Committing a batch hands it to the write-back cache; it reaches the
+// database with the next flush.
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    txdbCache.Apply(*activeBatch);
     delete activeBatch;
     activeBatch = NULL;
-    if (!status.ok()) {
-        LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
+    if (txdbCache.NeedsFlush())
+        return Flush();
+    return true;
+}
+
+// Per-thread buffers behind CTxDB::ReadBuffer() and CTxDB::WriteBuffer()
+struct CTxDBBuffers
+{
+    std::string strValue;
+    CDataStream ssValue;
+
+    CTxDBBuffers() : ssValue(SER_DISK, CLIENT_VERSION) {}
+};
+
+static boost::thread_specific_ptr<CTxDBBuffers> txdbBuffers;
+
+static CTxDBBuffers& GetTxDBBuffers()
+{
+    CTxDBBuffers* pbuffers = txdbBuffers.get();
+    if (!pbuffers)
+    {
+        pbuffers = new CTxDBBuffers();
+        txdbBuffers.reset(pbuffers);
+    }
+    return *pbuffers;
+}
+
+std::string& CTxDB::ReadBuffer()
+{
+    return GetTxDBBuffers().strValue;
+}
+
+CDataStream& CTxDB::WriteBuffer()
+{
+    CDataStream& ss = GetTxDBBuffers().ssValue;
+    ss.clear();
+    return ss;
+}
+
+leveldb::Status CTxDB::Get(const leveldb::Slice& key, std::string* pstrValue)
+{
+    if (activeBatch) {
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to read disk.
+        bool fErased = false;
+        if (activeBatch->Lookup(key, pstrValue, &fErased))
+            return fErased ? leveldb::Status::NotFound(leveldb::Slice()) : leveldb::Status::OK();
+    }
+
+    unsigned int nGeneration;
+    switch (txdbCache.Get(key, pstrValue, nGeneration))
+    {
+    case CTxDBCache::CACHE_FOUND:
+        return leveldb::Status::OK();
+    case CTxDBCache::CACHE_ERASED:
+        return leveldb::Status::NotFound(leveldb::Slice());
+    case CTxDBCache::CACHE_MISS:
+        break;
+    }
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), key, pstrValue);
+    if (status.ok())
+        txdbCache.AddClean(key, *pstrValue, nGeneration);
+    if (txdbRecorder.IsOpen())
+        txdbRecorder.Add(CTxDBRecord(CTxDBRecord::RECORD_GET, key.ToString(), status.ok() ? *pstrValue : std::string(), status.ok()));
+    return status;
+}
+
+bool CTxDB::GetProperty(const std::string& strName, std::string& strValue)
+{
+    LOCK(cs_txdb);
+    if (!txdb)
+        return false;
+    return txdb->GetProperty(strName, &strValue);
+}
+
+static bool ReadTxDBRecord(CAutoFile& filein, CTxDBRecord& record)
+{
+    try {
+        filein >> record;
+    }
+    catch (std::exception &e) {
         return false;
     }
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
+// Times ReadTxIndex on up to nCount transactions of the block database in
+// random order, first as read from LevelDB and then from the write-back cache
+bool CTxDB::BenchmarkReadTxIndex(unsigned int nCount)
+{
+    CTxDB txdb("r");
+    CTxDBKey keyStart(make_pair(string("tx"), uint256(0)));
+    leveldb::Slice prefix(keyStart.GetSlice().data(), keyStart.size() - sizeof(uint256));
+
+    vector<uint256> vHash;
+    leveldb::Iterator* iterator = txdb.pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(keyStart.GetSlice()); iterator->Valid() && vHash.size() < nCount; iterator->Next())
+    {
+        leveldb::Slice key = iterator->key();
+        if (!key.starts_with(prefix))
+            break;
+        if (key.size() != keyStart.size())
+            continue;
+        uint256 hash;
+        memcpy(hash.begin(), key.data() + prefix.size(), sizeof(hash));
+        vHash.push_back(hash);
     }
+    delete iterator;
+    random_shuffle(vHash.begin(), vHash.end(), GetRandInt);
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        unsigned int nFound = 0;
+        CTxIndex txindex;
+        int64_t nStart = GetTimeMicros();
+        BOOST_FOREACH(const uint256& hash, vHash)
+            if (txdb.ReadTxIndex(hash, txindex))
+                nFound++;
+        int64_t nTime = GetTimeMicros() - nStart;
+        LogPrintf("dbbench: ReadTxIndex %s: %u lookups (%u found) in %dms, %.2f us/lookup\n",
+            nPass == 0 ? "from disk" : "from cache", (unsigned int)vHash.size(), nFound,
+            nTime / 1000, vHash.empty() ? 0.0 : (double)nTime / vHash.size());
+    }
+    return true;
+}
+
+// Replays a workload written by -dbrecord against a scratch database opened
+// with the current -db* options. The values the recorded reads found that
+// the workload itself did not write are loaded first, so that the replay
+// starts from a database holding what the reads expect.
+bool CTxDB::Benchmark(const boost::filesystem::path& pathRecord)
+{
+    if (!BenchmarkReadTxIndex(DBBENCH_TXINDEX_READS))
+        return false;
+    if (pathRecord.empty())
+        return true;
+
+    FILE* file = fopen(pathRecord.string().c_str(), "rb");
+    if (!file)
+        return error("CTxDB::Benchmark() : cannot open %s", pathRecord.string());
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+
+    filesystem::path pathBench = GetDataDir() / "dbbench";
+    filesystem::remove_all(pathBench);
+    filesystem::create_directory(pathBench);
+
+    leveldb::Options options = GetOptions();
+    options.create_if_missing = true;
+    leveldb::DB* pdbBench = NULL;
+    leveldb::Status status = leveldb::DB::Open(options, pathBench.string(), &pdbBench);
+    if (!status.ok())
+        return error("CTxDB::Benchmark() : cannot open database: %s", status.ToString());
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = GetBoolArg("-dbsync", true);
+
+    // Load the initial state
+    int64_t nStart = GetTimeMillis();
+    std::set<std::string> setWritten;
+    leveldb::WriteBatch batchLoad;
+    unsigned int nLoaded = 0, nLoadBatch = 0;
+    CTxDBRecord record;
+    while (ReadTxDBRecord(filein, record))
+    {
+        if (record.nOp == CTxDBRecord::RECORD_PUT || record.nOp == CTxDBRecord::RECORD_DELETE)
+            setWritten.insert(record.strKey);
+        else if (record.nOp == CTxDBRecord::RECORD_GET && record.fFound && setWritten.insert(record.strKey).second)
+        {
+            batchLoad.Put(record.strKey, record.strValue);
+            nLoaded++;
+            if (++nLoadBatch == 10000)
+            {
+                pdbBench->Write(leveldb::WriteOptions(), &batchLoad);
+                batchLoad.Clear();
+                nLoadBatch = 0;
+            }
+        }
+    }
+    pdbBench->Write(leveldb::WriteOptions(), &batchLoad);
+    setWritten.clear();
+    pdbBench->CompactRange(NULL, NULL);
+    LogPrintf("dbbench: loaded %u entries in %dms\n", nLoaded, GetTimeMillis() - nStart);
+
+    // Replay
+    filein.clear();
+    rewind(filein);
+    int64_t nGets = 0, nFound = 0, nWrites = 0, nCommits = 0, nBytesWritten = 0;
+    int64_t nGetMicros = 0, nCommitMicros = 0;
+    leveldb::WriteBatch batch;
+    std::string strValue;
+    while (ReadTxDBRecord(filein, record))
+    {
+        if (record.nOp == CTxDBRecord::RECORD_GET)
+        {
+            int64_t nTime = GetTimeMicros();
+            if (pdbBench->Get(leveldb::ReadOptions(), record.strKey, &strValue).ok())
+                nFound++;
+            nGetMicros += GetTimeMicros() - nTime;
+            nGets++;
+        }
+        else if (record.nOp == CTxDBRecord::RECORD_PUT)
+        {
+            batch.Put(record.strKey, record.strValue);
+            nBytesWritten += record.strKey.size() + record.strValue.size();
+            nWrites++;
+        }
+        else if (record.nOp == CTxDBRecord::RECORD_DELETE)
+        {
+            batch.Delete(record.strKey);
+            nBytesWritten += record.strKey.size();
+            nWrites++;
+        }
+        else if (record.nOp == CTxDBRecord::RECORD_COMMIT)
+        {
+            int64_t nTime = GetTimeMicros();
+            status = pdbBench->Write(writeOptions, &batch);
+            nCommitMicros += GetTimeMicros() - nTime;
+            batch.Clear();
+            nCommits++;
+            if (!status.ok())
+            {
+                LogPrintf("dbbench: batch write failure: %s\n", status.ToString());
+                break;
+            }
         }
     }
-};
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    LogPrintf("dbbench: %d reads (%d found) in %dms, %.1f us/read\n",
+        nGets, nFound, nGetMicros / 1000, nGets ? (double)nGetMicros / nGets : 0.0);
+    LogPrintf("dbbench: %d writes (%.1f MiB) in %d batches in %dms, %.1f MiB/s\n",
+        nWrites, nBytesWritten / 1048576.0, nCommits, nCommitMicros / 1000,
+        nCommitMicros ? nBytesWritten / 1048576.0 / (nCommitMicros / 1000000.0) : 0.0);
+    std::string strStats;
+    if (pdbBench->GetProperty("leveldb.stats", &strStats))
+        LogPrintf("dbbench: %s\n", strStats);
+
+    delete pdbBench;
+    delete options.filter_policy;
+    delete options.block_cache;
+    filesystem::remove_all(pathBench);
+    return status.ok();
+}
+
+bool CTxDB::Put(const leveldb::Slice& key, const leveldb::Slice& value)
+{
+    if (activeBatch) {
+        activeBatch->Put(key, value);
+        return true;
     }
-    return scanner.foundEntry;
+    txdbCache.Put(key, value);
+    if (txdbCache.NeedsFlush())
+        return Flush();
+    return true;
+}
+
+bool CTxDB::Delete(const leveldb::Slice& key)
+{
+    if (activeBatch) {
+        activeBatch->Delete(key);
+        return true;
+    }
+    txdbCache.Delete(key);
+    if (txdbCache.NeedsFlush())
+        return Flush();
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -207,11 +643,39 @@ bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
     return Read(make_pair(string("tx"), hash), txindex);
 }
 
+// Besides the record itself this writes where each output was spent, for
+// the outputs whose spend is known here. The outputs spent before the
+// record was read are SpentPosUnread() and their spend records stay as they
+// are. A spend record left behind by a disconnected spend is ignored while
+// the output is unspent and overwritten when it is spent again.
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
+    for (unsigned int n = 0; n < txindex.vSpent.size(); n++)
+    {
+        CDiskTxPos posSpent = txindex.vSpent[n];
+        if (posSpent.IsNull() || posSpent == CTxIndex::SpentPosUnread())
+            continue;
+        if (!Write(make_pair(string("txspent"), make_pair(hash, n)), CDiskTxPosCompressor(posSpent)))
+            return false;
+    }
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
+bool CTxDB::ReadTxSpent(uint256 hash, unsigned int n, CDiskTxPos& posSpent)
+{
+    posSpent.SetNull();
+    CDiskTxPosCompressor compressor(posSpent);
+    return Read(make_pair(string("txspent"), make_pair(hash, n)), compressor);
+}
+
+bool CTxDB::ReadTxSpentPositions(uint256 hash, CTxIndex& txindex)
+{
+    for (unsigned int n = 0; n < txindex.vSpent.size(); n++)
+        if (txindex.vSpent[n] == CTxIndex::SpentPosUnread() && !ReadTxSpent(hash, n, txindex.vSpent[n]))
+            return false;
+    return true;
+}
+
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
 {
     // Add to tx index
@@ -224,6 +688,8 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
+    for (unsigned int n = 0; n < tx.vout.size(); n++)
+        Erase(make_pair(string("txspent"), make_pair(hash, n)));
     return Erase(make_pair(string("tx"), hash));
 }
 
@@ -257,6 +723,38 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadCoin(const COutPoint& outpoint, CCoin& coin)
+{
+    coin.SetNull();
+    return Read(make_pair(string("utxo"), outpoint), coin);
+}
+
+bool CTxDB::WriteCoin(const COutPoint& outpoint, const CCoin& coin)
+{
+    return Write(make_pair(string("utxo"), outpoint), coin);
+}
+
+bool CTxDB::EraseCoin(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("utxo"), outpoint));
+}
+
+bool CTxDB::ReadBlockUndo(const uint256& hash, CBlockUndo& undo)
+{
+    undo.vSpent.clear();
+    return Read(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::WriteBlockUndo(const uint256& hash, const CBlockUndo& undo)
+{
+    return Write(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::EraseBlockUndo(const uint256& hash)
+{
+    return Erase(make_pair(string("blockundo"), hash));
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
@@ -282,26 +780,277 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+bool CTxDB::ReadBlockFilesPruned(bool& fPruned)
+{
+    fPruned = false;
+    return Read(string("prunedblockfiles"), fPruned);
+}
+
+bool CTxDB::WriteBlockFilesPruned(bool fPruned)
+{
+    return Write(string("prunedblockfiles"), fPruned);
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Construct the block index object of diskindex and link it to its
+// neighbours. The caller knows the block hash already, from the database key
+// or from the snapshot entry, so it is not computed again here.
+static CBlockIndex *LinkBlockIndex(const uint256& blockHash, const CDiskBlockIndex& diskindex)
+{
+    CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nBlockPos      = diskindex.nBlockPos;
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nMint          = diskindex.nMint;
+    pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+    pindexNew->nFlags         = diskindex.nFlags;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+    pindexNew->prevoutStake   = diskindex.prevoutStake;
+    pindexNew->nStakeTime     = diskindex.nStakeTime;
+    pindexNew->hashProof      = diskindex.hashProof;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+        pindexGenesisBlock = pindexNew;
+
+    if (!pindexNew->CheckIndex())
+    {
+        error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        return NULL;
+    }
+
+    // NovaCoin: build setStakeSeen
+    if (pindexNew->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+    return pindexNew;
+}
+
+//
+// Block index snapshot
+//
+// At shutdown the whole block index is written to blkindex.dat in height
+// order, in chunks that each carry a checksum. At startup several chunks at a
+// time are decoded on worker threads, which is where the block hashes are
+// computed, and then linked into mapBlockIndex in file order. Parents come
+// before their children, so the chain trust is summed up as entries are
+// linked instead of sorting the whole index afterwards.
+//
+// The snapshot is only used if it was written at the best chain stored in
+// the database, and it is removed once read, so after an unclean shutdown the
+// index is read from LevelDB again.
+//
+static const unsigned int BLOCK_INDEX_SNAPSHOT_MAGIC = 0x78646962; // "bidx"
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+static const unsigned int BLOCK_INDEX_SNAPSHOT_CHUNK = 16384;
+
+static filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.dat";
+}
+
+class CBlockIndexSnapshotChunk
+{
+public:
+    std::vector<unsigned char> vData;
+    uint256 hashChecksum;
+
+    // Filled in by Decode()
+    std::vector<CDiskBlockIndex> vIndex;
+    std::vector<uint256> vHash;
+    bool fValid;
+
+    CBlockIndexSnapshotChunk() : fValid(false) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vData);
+        READWRITE(hashChecksum);
+    )
+
+    void Decode()
+    {
+        if (Hash(vData.begin(), vData.end()) != hashChecksum)
+            return;
+        try {
+            CDataStream ss(vData, SER_DISK, CLIENT_VERSION);
+            while (!ss.empty())
+            {
+                vIndex.push_back(CDiskBlockIndex());
+                ss >> vIndex.back();
+                vHash.push_back(vIndex.back().GetBlockHash());
+            }
+        }
+        catch (std::exception &e) {
+            return;
+        }
+        fValid = true;
+    }
+};
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+    if (!GetBoolArg("-indexsnapshot", true) || pindexBest == NULL)
+        return true;
+    int64_t nStart = GetTimeMillis();
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    filesystem::path path = GetBlockIndexSnapshotPath();
+    filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    try {
+        fileout << BLOCK_INDEX_SNAPSHOT_MAGIC << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain;
+        fileout << (uint64_t)vSortedByHeight.size();
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        CBlockIndexSnapshotChunk chunk;
+        for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+        {
+            ss << CDiskBlockIndex(vSortedByHeight[i].second);
+            if ((i + 1) % BLOCK_INDEX_SNAPSHOT_CHUNK == 0 || i + 1 == vSortedByHeight.size())
+            {
+                chunk.vData.assign(ss.begin(), ss.end());
+                chunk.hashChecksum = Hash(chunk.vData.begin(), chunk.vData.end());
+                fileout << chunk;
+                ss.clear();
+            }
+        }
+        FileCommit(fileout);
+    }
+    catch (std::exception &e) {
+        fileout.fclose();
+        filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : %s", e.what());
+    }
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path))
+        return error("WriteBlockIndexSnapshot() : rename failed");
+    LogPrintf("WriteBlockIndexSnapshot(): %u entries in %dms\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::ReadBlockIndexSnapshot(const filesystem::path& path)
+{
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    try {
+        unsigned int nMagic;
+        int nVersion;
+        uint256 hashSnapshotBest, hashBest;
+        uint64_t nEntries;
+        filein >> nMagic >> nVersion >> hashSnapshotBest >> nEntries;
+        if (nMagic != BLOCK_INDEX_SNAPSHOT_MAGIC || nVersion != BLOCK_INDEX_SNAPSHOT_VERSION)
+            return error("ReadBlockIndexSnapshot() : unknown format");
+        if (!ReadHashBestChain(hashBest) || hashBest != hashSnapshotBest)
+            return error("ReadBlockIndexSnapshot() : snapshot does not match the best chain");
+
+        unsigned int nThreads = std::max(1U, boost::thread::hardware_concurrency());
+        uint64_t nLoaded = 0;
+        while (nLoaded < nEntries)
+        {
+            boost::this_thread::interruption_point();
+
+            // Read the next chunks and decode them all at once
+            uint64_t nChunksLeft = (nEntries - nLoaded + BLOCK_INDEX_SNAPSHOT_CHUNK - 1) / BLOCK_INDEX_SNAPSHOT_CHUNK;
+            vector<CBlockIndexSnapshotChunk> vChunks(std::min((uint64_t)nThreads, nChunksLeft));
+            BOOST_FOREACH(CBlockIndexSnapshotChunk& chunk, vChunks)
+                filein >> chunk;
+            boost::thread_group threadGroup;
+            for (unsigned int i = 1; i < vChunks.size(); i++)
+                threadGroup.create_thread(boost::bind(&CBlockIndexSnapshotChunk::Decode, &vChunks[i]));
+            vChunks[0].Decode();
+            threadGroup.join_all();
+
+            BOOST_FOREACH(const CBlockIndexSnapshotChunk& chunk, vChunks)
+            {
+                if (!chunk.fValid)
+                    return error("ReadBlockIndexSnapshot() : corrupt chunk after %u entries", nLoaded);
+                for (unsigned int i = 0; i < chunk.vIndex.size(); i++)
+                {
+                    CBlockIndex* pindexNew = LinkBlockIndex(chunk.vHash[i], chunk.vIndex[i]);
+                    if (!pindexNew)
+                        return false;
+                    // The parent must have been linked already, which is known
+                    // from its trust: every block adds some
+                    CBlockIndex* pindexPrev = pindexNew->pprev;
+                    if (pindexPrev && (pindexPrev->nChainTrust == 0 || pindexPrev->nHeight + 1 != pindexNew->nHeight))
+                        return error("ReadBlockIndexSnapshot() : block %s out of order", chunk.vHash[i].ToString());
+                    pindexNew->nChainTrust = (pindexPrev ? pindexPrev->nChainTrust : 0) + pindexNew->GetBlockTrust();
+                }
+                nLoaded += chunk.vIndex.size();
+            }
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadBlockIndexSnapshot() : %s", e.what());
+    }
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    filesystem::path path = GetBlockIndexSnapshotPath();
+    if (!filesystem::exists(path))
+        return false;
+    if (!GetBoolArg("-indexsnapshot", true))
+    {
+        // A snapshot from an earlier run would be stale by the next start
+        filesystem::remove(path);
+        return false;
+    }
+
+    bool fLoaded = ReadBlockIndexSnapshot(path);
+    filesystem::remove(path);
+    if (!fLoaded)
+    {
+        // Start over from the database. The entries linked so far stay in
+        // the arena, but this only happens once and only on a bad snapshot.
+        mapBlockIndex.clear();
+        setStakeSeen.clear();
+        pindexGenesisBlock = NULL;
+    }
+    return fLoaded;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -310,86 +1059,79 @@ bool CTxDB::LoadBlockIndex()
         return true;
     }
     // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    // locations where the contents of the block can be found. Here, we read
+    // it from the snapshot of the last clean shutdown, or scan it out of the
+    // DB, into mapBlockIndex.
+    int64_t nStart = GetTimeMillis();
+    bool fSnapshot = LoadBlockIndexSnapshot();
+    int64_t nTimeLoad = GetTimeMillis() - nStart;
+    int64_t nTimeTrust = 0;
+    if (!fSnapshot)
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        // Seek to start key.
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(string("blockindex"), uint256(0));
+        iterator->Seek(ssStartKey.str());
+        // Now read each entry.
+        while (iterator->Valid())
+        {
+            boost::this_thread::interruption_point();
+            // Unpack keys and values.
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey.write(iterator->key().data(), iterator->key().size());
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue.write(iterator->value().data(), iterator->value().size());
+            string strType;
+            ssKey >> strType;
+            // Did we reach the end of the data to read?
+            if (strType != "blockindex")
+                break;
+            uint256 blockHash;
+            ssKey >> blockHash;
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            // Without -fastindex every entry is checked against its header
+            if (!fUseFastIndex && diskindex.GetBlockHash() != blockHash) {
+                delete iterator;
+                return error("LoadBlockIndex() : block %s is stored under the wrong hash", blockHash.ToString());
+            }
+            if (!LinkBlockIndex(blockHash, diskindex)) {
+                delete iterator;
+                return false;
+            }
+
+            iterator->Next();
         }
+        delete iterator;
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        boost::this_thread::interruption_point();
+        nTimeLoad = GetTimeMillis() - nStart;
 
-        iterator->Next();
+        // Calculate nChainTrust
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        }
+        nTimeTrust = GetTimeMillis() - nStart - nTimeLoad;
     }
-    delete iterator;
-
-    boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-    }
+    // Node size of the hash table: the entry plus the bucket chain links
+    size_t nTableBytes = mapBlockIndex.bucket_count() * sizeof(void*) +
+        mapBlockIndex.size() * (sizeof(BlockMap::value_type) + 2 * sizeof(void*));
+    LogPrintf("LoadBlockIndex(): %u entries from %s in %dms (chain trust %dms), index %uKiB, hash table ~%uKiB in %u buckets\n",
+      mapBlockIndex.size(), fSnapshot ? "snapshot" : "database", nTimeLoad + nTimeTrust, nTimeTrust,
+      GetBlockIndexArenaBytes() >> 10, nTableBytes >> 10, mapBlockIndex.bucket_count());
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -401,6 +1143,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -420,7 +1163,10 @@ bool CTxDB::LoadBlockIndex()
         nCheckDepth = 1000000000; // suffices until the year 19000
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
+    if (fPruneMode && nCheckDepth > MIN_BLOCKS_TO_KEEP)
+        nCheckDepth = MIN_BLOCKS_TO_KEEP; // older blocks may be gone
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    int64_t nStartVerify = GetTimeMillis();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
@@ -470,6 +1216,11 @@ bool CTxDB::LoadBlockIndex()
                     unsigned int nOutput = 0;
                     if (nCheckLevel>3)
                     {
+                        if (!ReadTxSpentPositions(hashTx, txindex))
+                        {
+                            LogPrintf("LoadBlockIndex(): *** cannot read where outputs of %s were spent\n", hashTx.ToString());
+                            pindexFork = pindex->pprev;
+                        }
                         BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
                         {
                             if (!txpos.IsNull())
@@ -529,6 +1280,7 @@ bool CTxDB::LoadBlockIndex()
             }
         }
     }
+    LogPrintf("LoadBlockIndex(): verified in %dms\n", GetTimeMillis() - nStartVerify);
     if (pindexFork)
     {
         boost::this_thread::interruption_point();
@@ -12,9 +12,351 @@
 #include <string>
 #include <vector>
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Default for -dbwritebuffer, in MiB */
+static const int64_t DEFAULT_DB_WRITE_BUFFER = 4;
+/** Default for -dbmaxopenfiles */
+static const int64_t DEFAULT_DB_MAX_OPEN_FILES = 1000;
+/** Default for -dbblocksize, in KiB */
+static const int64_t DEFAULT_DB_BLOCK_SIZE = 4;
+/** Default for -dbbloombits, 0 turns the bloom filter off */
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+
+// Hash and equality of the serialized database keys in the txdb hash tables.
+// Both take a leveldb::Slice as well, so that a key serialized on the stack
+// is looked up without first copying it into a std::string.
+struct CTxDBKeyHash
+{
+    size_t operator()(const leveldb::Slice& key) const
+    {
+        return boost::hash_range(key.data(), key.data() + key.size());
+    }
+    size_t operator()(const std::string& strKey) const
+    {
+        return boost::hash_range(strKey.data(), strKey.data() + strKey.size());
+    }
+};
+
+struct CTxDBKeyEqual
+{
+    bool operator()(const leveldb::Slice& a, const leveldb::Slice& b) const
+    {
+        return a == b;
+    }
+};
+
+// The changes made inside a CTxDB transaction, held in a hash table keyed by
+// the serialized database key. Only the last change to each key is kept, so
+// reads inside a transaction find pending writes and deletes in constant time
+// however large the transaction grows.
+class CTxDBBatch
+{
+public:
+    struct CEntry
+    {
+        std::string strValue;
+        bool fErased;
+    };
+    typedef boost::unordered_map<std::string, CEntry, CTxDBKeyHash, CTxDBKeyEqual> EntryMap;
+
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        CEntry& entry = GetEntry(key);
+        entry.strValue.assign(value.data(), value.size());
+        entry.fErased = false;
+    }
+
+    void Delete(const leveldb::Slice& key)
+    {
+        CEntry& entry = GetEntry(key);
+        entry.strValue.clear();
+        entry.fErased = true;
+    }
+
+    // Returns true if the batch holds a change for the key. The value is set
+    // for a write and left alone for a delete.
+    bool Lookup(const leveldb::Slice& key, std::string* pstrValue, bool* pfErased) const
+    {
+        EntryMap::const_iterator mi = mapEntries.find(key, CTxDBKeyHash(), CTxDBKeyEqual());
+        if (mi == mapEntries.end())
+            return false;
+        *pfErased = (*mi).second.fErased;
+        if (!*pfErased)
+            *pstrValue = (*mi).second.strValue;
+        return true;
+    }
+
+    const EntryMap& GetEntries() const { return mapEntries; }
+    size_t size() const { return mapEntries.size(); }
+
+private:
+    EntryMap mapEntries;
+
+    CEntry& GetEntry(const leveldb::Slice& key)
+    {
+        EntryMap::iterator mi = mapEntries.find(key, CTxDBKeyHash(), CTxDBKeyEqual());
+        if (mi == mapEntries.end())
+            mi = mapEntries.insert(std::make_pair(key.ToString(), CEntry())).first;
+        return (*mi).second;
+    }
+};
+
+// Rough per-entry overhead of the cache maps, in bytes
+static const size_t TXDB_CACHE_ENTRY_OVERHEAD = 96;
+
+// The write-back cache in front of the LevelDB, one per process. Committed changes
+// are kept as dirty entries and written out together in a single batch once
+// they use up the cache budget, or when CTxDB::Flush() is called, so a long
+// run of connected blocks costs one database write. Values read from the
+// database are kept as clean entries in whatever room is left, and clean
+// entries picked at random make way for new ones.
+//
+// Readers that miss take a generation number first, so that a value they
+// read from disk is not cached if a flush raced with the read.
+class CTxDBCache
+{
+public:
+    enum LookupResult
+    {
+        CACHE_MISS,
+        CACHE_FOUND,
+        CACHE_ERASED,
+    };
+
+private:
+    struct CDirtyEntry
+    {
+        std::string strValue;
+        bool fErased;
+    };
+
+    struct CCleanEntry
+    {
+        std::string strValue;
+        size_t nIndex;  // position in vClean
+    };
+    typedef boost::unordered_map<std::string, CDirtyEntry, CTxDBKeyHash, CTxDBKeyEqual> DirtyMap;
+    typedef boost::unordered_map<std::string, CCleanEntry, CTxDBKeyHash, CTxDBKeyEqual> CleanMap;
+
+    DirtyMap mapDirty;
+    CleanMap mapClean;
+    // Every clean entry in no particular order, to pick one to evict at random
+    std::vector<CleanMap::value_type*> vClean;
+    size_t nDirtyBytes;
+    size_t nCleanBytes;
+    size_t nBudget;
+    unsigned int nGeneration;
+    bool fSync;
+    CCriticalSection cs_cache;
+
+public:
+    CTxDBCache() : nDirtyBytes(0), nCleanBytes(0), nBudget(0), nGeneration(0), fSync(true) {}
+
+    void SetBudget(size_t nBudgetIn)
+    {
+        LOCK(cs_cache);
+        nBudget = nBudgetIn;
+    }
+
+    void SetSync(bool fSyncIn)
+    {
+        LOCK(cs_cache);
+        fSync = fSyncIn;
+    }
+
+    LookupResult Get(const leveldb::Slice& key, std::string* pstrValue, unsigned int& nGenerationRet)
+    {
+        LOCK(cs_cache);
+        DirtyMap::const_iterator mi = mapDirty.find(key, CTxDBKeyHash(), CTxDBKeyEqual());
+        if (mi != mapDirty.end())
+        {
+            if ((*mi).second.fErased)
+                return CACHE_ERASED;
+            *pstrValue = (*mi).second.strValue;
+            return CACHE_FOUND;
+        }
+        CleanMap::const_iterator mc = mapClean.find(key, CTxDBKeyHash(), CTxDBKeyEqual());
+        if (mc != mapClean.end())
+        {
+            *pstrValue = (*mc).second.strValue;
+            return CACHE_FOUND;
+        }
+        nGenerationRet = nGeneration;
+        return CACHE_MISS;
+    }
+
+    void AddClean(const leveldb::Slice& key, const leveldb::Slice& value, unsigned int nGenerationRead)
+    {
+        LOCK(cs_cache);
+        if (nGenerationRead != nGeneration || mapDirty.find(key, CTxDBKeyHash(), CTxDBKeyEqual()) != mapDirty.end())
+            return;
+        InsertClean(key, value);
+    }
+
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        LOCK(cs_cache);
+        SetDirty(key, value, false);
+    }
+
+    void Delete(const leveldb::Slice& key)
+    {
+        LOCK(cs_cache);
+        SetDirty(key, leveldb::Slice(), true);
+    }
+
+    // Take over the contents of a committed batch in one step, so that
+    // other readers see all of it or none of it
+    void Apply(const CTxDBBatch& batch)
+    {
+        LOCK(cs_cache);
+        const CTxDBBatch::EntryMap& mapEntries = batch.GetEntries();
+        for (CTxDBBatch::EntryMap::const_iterator mi = mapEntries.begin(); mi != mapEntries.end(); ++mi)
+            SetDirty((*mi).first, (*mi).second.strValue, (*mi).second.fErased);
+    }
+
+    bool NeedsFlush()
+    {
+        LOCK(cs_cache);
+        return nDirtyBytes > nBudget;
+    }
+
+    // Writes the dirty entries to pdb in a single batch
+    bool Flush(leveldb::DB *pdb);
+
+    void Clear()
+    {
+        LOCK(cs_cache);
+        nGeneration++;
+        mapDirty.clear();
+        mapClean.clear();
+        vClean.clear();
+        nDirtyBytes = nCleanBytes = 0;
+    }
+
+private:
+    static size_t EntrySize(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        return key.size() + value.size() + TXDB_CACHE_ENTRY_OVERHEAD;
+    }
+
+    void EraseClean(const leveldb::Slice& key)
+    {
+        CleanMap::iterator mc = mapClean.find(key, CTxDBKeyHash(), CTxDBKeyEqual());
+        if (mc != mapClean.end())
+            EraseClean(mc);
+    }
+
+    void EraseClean(CleanMap::iterator mc)
+    {
+        // Move the last entry of vClean into the place of this one
+        size_t nIndex = (*mc).second.nIndex;
+        vClean[nIndex] = vClean.back();
+        vClean[nIndex]->second.nIndex = nIndex;
+        vClean.pop_back();
+        nCleanBytes -= EntrySize((*mc).first, (*mc).second.strValue);
+        mapClean.erase(mc);
+    }
+
+    void SetDirty(const leveldb::Slice& key, const leveldb::Slice& value, bool fErased)
+    {
+        EraseClean(key);
+        DirtyMap::iterator mi = mapDirty.find(key, CTxDBKeyHash(), CTxDBKeyEqual());
+        if (mi != mapDirty.end())
+            nDirtyBytes -= EntrySize((*mi).first, (*mi).second.strValue);
+        else
+            mi = mapDirty.insert(std::make_pair(key.ToString(), CDirtyEntry())).first;
+        (*mi).second.strValue.assign(value.data(), value.size());
+        (*mi).second.fErased = fErased;
+        nDirtyBytes += EntrySize(key, value);
+
+        // Make room by dropping clean entries first
+        while (!mapClean.empty() && nDirtyBytes + nCleanBytes > nBudget)
+            EvictClean();
+    }
+
+    void InsertClean(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        EraseClean(key);
+        size_t nSize = EntrySize(key, value);
+        if (nDirtyBytes + nSize > nBudget)
+            return;
+        while (!mapClean.empty() && nDirtyBytes + nCleanBytes + nSize > nBudget)
+            EvictClean();
+        CleanMap::iterator mc = mapClean.insert(std::make_pair(key.ToString(), CCleanEntry())).first;
+        (*mc).second.strValue.assign(value.data(), value.size());
+        (*mc).second.nIndex = vClean.size();
+        vClean.push_back(&*mc);
+        nCleanBytes += nSize;
+    }
+
+    void EvictClean()
+    {
+        // Evict a random entry
+        CleanMap::value_type* pentry = vClean[GetRand(vClean.size())];
+        EraseClean(mapClean.find(pentry->first));
+    }
+};
+
+/** Number of transactions -dbbench looks up with ReadTxIndex */
+static const unsigned int DBBENCH_TXINDEX_READS = 100000;
+
+/** Longest serialized key CTxDB uses */
+static const size_t TXDB_MAX_KEY_SIZE = 64;
+
+// A database key serialized into a buffer on the stack. The keys CTxDB uses
+// are a short type string, optionally followed by a hash or an outpoint, so
+// they all fit without a heap allocation.
+class CTxDBKey
+{
+private:
+    char vch[TXDB_MAX_KEY_SIZE];
+    size_t nSize;
+
+public:
+    int nType;
+    int nVersion;
+
+    template<typename K>
+    explicit CTxDBKey(const K& key) : nSize(0), nType(SER_DISK), nVersion(CLIENT_VERSION)
+    {
+        ::Serialize(*this, key, nType, nVersion);
+    }
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CTxDBKey& write(const char* pch, size_t nWrite)
+    {
+        if (nSize + nWrite > sizeof(vch))
+            throw std::ios_base::failure("CTxDBKey::write() : key too long");
+        memcpy(vch + nSize, pch, nWrite);
+        nSize += nWrite;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CTxDBKey& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    leveldb::Slice GetSlice() const { return leveldb::Slice(vch, nSize); }
+    size_t size() const { return nSize; }
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -40,54 +382,65 @@ public:
     // Destroys the underlying shared global state accessed by this TxDB.
     void Close();
 
+    // Writes everything held by the write-back cache to the database.
+    static bool Flush();
+
+    // Holds back the LevelDB background compactions that writes do not wait
+    // for, until nSeconds from now or until ResumeCompaction(true).
+    static void DeferCompaction(int64_t nSeconds);
+    // Lets deferred compactions run again once the deferral has run out, or
+    // at once with fForce. Returns false while compactions are deferred.
+    static bool ResumeCompaction(bool fForce = false);
+    // Compacts the whole database and logs how long that took.
+    static bool Compact();
+
+    // Reads a LevelDB property such as "leveldb.stats".
+    static bool GetProperty(const std::string& strName, std::string& strValue);
+
+    // Times ReadTxIndex against the block database, then replays a workload
+    // recorded with -dbrecord, if given, against the -db* options and logs
+    // how long the reads and batch writes took.
+    static bool Benchmark(const boost::filesystem::path& pathRecord);
+    static bool BenchmarkReadTxIndex(unsigned int nCount);
+
 private:
     leveldb::DB *pdb;  // Points to the global instance.
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    CTxDBBatch *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
-protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
-    bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
+    // Access to the database through the active batch, if any, and the
+    // process-wide write-back cache.
+    leveldb::Status Get(const leveldb::Slice& key, std::string* pstrValue);
+    bool Put(const leveldb::Slice& key, const leveldb::Slice& value);
+    bool Delete(const leveldb::Slice& key);
 
+    // Buffers of the calling thread that values are read into and written
+    // from, reused so that reads and writes do not allocate.
+    static std::string& ReadBuffer();
+    static CDataStream& WriteBuffer();
+
+protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        std::string strValue;
-
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
-        }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        CTxDBKey dbkey(key);
+        std::string& strValue = ReadBuffer();
+        leveldb::Status status = Get(dbkey.GetSlice(), &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
                 return false;
-            }
+            // Some unexpected error.
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+            return false;
         }
-        // Unserialize value
+        // Unserialize value in place
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
+            CSpanReader ssValue(strValue.data(), strValue.data() + strValue.size(),
                                 SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         }
@@ -103,23 +456,10 @@ protected:
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
+        CTxDBKey dbkey(key);
+        CDataStream& ssValue = WriteBuffer();
         ssValue << value;
-
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        return Put(dbkey.GetSlice(), leveldb::Slice(ssValue.empty() ? "" : &ssValue[0], ssValue.size()));
     }
 
     template<typename K>
@@ -130,34 +470,15 @@ protected:
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        CTxDBKey dbkey(key);
+        return Delete(dbkey.GetSlice());
     }
 
     template<typename K>
     bool Exists(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        std::string unused;
-
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
-
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
+        CTxDBKey dbkey(key);
+        leveldb::Status status = Get(dbkey.GetSlice(), &ReadBuffer());
         return status.IsNotFound() == false;
     }
 
@@ -185,6 +506,10 @@ public:
 
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
+    // Where output n of a transaction was spent, and all SpentPosUnread()
+    // entries of txindex replaced by where the outputs were spent.
+    bool ReadTxSpent(uint256 hash, unsigned int n, CDiskTxPos& posSpent);
+    bool ReadTxSpentPositions(uint256 hash, CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
@@ -192,14 +517,25 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadCoin(const COutPoint& outpoint, CCoin& coin);
+    bool WriteCoin(const COutPoint& outpoint, const CCoin& coin);
+    bool EraseCoin(const COutPoint& outpoint);
+    bool ReadBlockUndo(const uint256& hash, CBlockUndo& undo);
+    bool WriteBlockUndo(const uint256& hash, const CBlockUndo& undo);
+    bool EraseBlockUndo(const uint256& hash);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
+    bool ReadBlockFilesPruned(bool& fPruned);
+    bool WriteBlockFilesPruned(bool fPruned);
     bool LoadBlockIndex();
+    static bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
+    bool ReadBlockIndexSnapshot(const boost::filesystem::path& path);
 };
 
 
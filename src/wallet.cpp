@@ -14,6 +14,8 @@
 #include "ui_interface.h"
 #include "walletdb.h"
 
+#include "checkqueue.h"
+
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -22,10 +24,60 @@ using namespace std;
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+int nStakeThreads = 1;
+double dKernelsPerSec = 0.0;
 
 static int64_t GetStakeCombineThreshold() { return 500 * COIN; } // changed from 100
 static int64_t GetStakeSplitThreshold() { return 2 * GetStakeCombineThreshold(); }
 
+// Kernel inputs of the coins tried by CreateCoinStake on the current tip
+static CStakeKernelCache stakeKernelCache;
+
+/** Kernel checks of one chunk of the coins CreateCoinStake tries. A check
+ *  fails when its chunk holds a kernel or the tip has moved, which makes
+ *  the queue skip the chunks that are left. */
+class CStakeKernelCheck
+{
+private:
+    CBlockIndex* pindexPrev;
+    vector<pair<int, unsigned int> > vCandidates;
+    vector<bool>* pvfKernel;
+    char* pfChecked;
+
+public:
+    CStakeKernelCheck() : pindexPrev(NULL), pvfKernel(NULL), pfChecked(NULL) {}
+    CStakeKernelCheck(CBlockIndex* pindexPrevIn, vector<bool>* pvfKernelIn, char* pfCheckedIn) :
+        pindexPrev(pindexPrevIn), pvfKernel(pvfKernelIn), pfChecked(pfCheckedIn) {}
+
+    vector<pair<int, unsigned int> >& Candidates() { return vCandidates; }
+
+    bool operator()()
+    {
+        if (pindexPrev != pindexBest)
+            return false;
+        stakeKernelCache.CheckKernels(pindexPrev, vCandidates, *pvfKernel);
+        *pfChecked = 1;
+        return find(pvfKernel->begin(), pvfKernel->end(), true) == pvfKernel->end();
+    }
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(pindexPrev, check.pindexPrev);
+        vCandidates.swap(check.vCandidates);
+        std::swap(pvfKernel, check.pvfKernel);
+        std::swap(pfChecked, check.pfChecked);
+    }
+};
+
+static CCheckQueue<CStakeKernelCheck> stakecheckqueue(1);
+
+void ThreadStakeCheck()
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("altcommunitycoin-stakech");
+    stakecheckqueue.Thread();
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapWallet
@@ -925,7 +977,10 @@ void CWallet::ReacceptWalletTransactions()
                     {
                         wtx.MarkSpent(i);
                         fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        CDiskTxPos posSpent = txindex.vSpent[i];
+                        if (posSpent == CTxIndex::SpentPosUnread() && !txdb.ReadTxSpent(wtx.GetHash(), i, posSpent))
+                            continue;
+                        vMissingTx.push_back(posSpent);
                     }
                 }
                 if (fUpdated)
@@ -1630,80 +1685,142 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     CTxDB txdb("r");
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nSearchTimes = (unsigned int)max((int64_t)0, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval));
+    vector<pair<const CWalletTx*, unsigned int> > vStakeCoins;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
-    {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        vStakeCoins.push_back(pcoin);
+
+    // The kernels of a chunk of coins are hashed as one batch, and the
+    // chunks are spread over the -stakethreads threads. The search stops at
+    // the first chunk that holds a kernel or when the tip moves; if none of
+    // the kernels found can be used, the chunks not checked yet are queued
+    // again. Kernels are taken in coin and time order among the chunks
+    // checked, as with a single thread.
+    unsigned int nChunks = (vStakeCoins.size() + STAKE_KERNEL_BATCH_COINS - 1) / STAKE_KERNEL_BATCH_COINS;
+    vector<vector<bool> > vvfKernel(nChunks);
+    vector<char> vfChecked(nChunks, 0);
+    vector<char> vfTried(nChunks, 0);
+    int64_t nSearchStart = GetTimeMicros();
+    uint64_t nKernelsChecked = 0;
+    bool fKernelFound = false;
+    while (!fKernelFound && pindexPrev == pindexBest)
+    {
+        boost::this_thread::interruption_point();
+        // Search backward in time from the given txNew timestamp
+        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+        vector<CStakeKernelCheck> vChecks;
+        for (unsigned int c = 0; c < nChunks; c++)
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
+            if (vfChecked[c])
+                continue;
+            vChecks.push_back(CStakeKernelCheck(pindexPrev, &vvfKernel[c], &vfChecked[c]));
+            vector<pair<int, unsigned int> >& vCandidates = vChecks.back().Candidates();
+            for (unsigned int i = c * STAKE_KERNEL_BATCH_COINS; i < min((unsigned int)vStakeCoins.size(), (c + 1) * STAKE_KERNEL_BATCH_COINS); i++)
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+                COutPoint prevoutStake = COutPoint(vStakeCoins[i].first->GetHash(), vStakeCoins[i].second);
+                int nKernelInput = stakeKernelCache.Load(txdb, pindexPrev, nBits, prevoutStake);
+                for (unsigned int n = 0; n < nSearchTimes; n++)
+                    vCandidates.push_back(make_pair(nKernelInput, txNew.nTime - n));
+            }
+        }
+        if (vChecks.empty())
+            break;
+
+        if (nStakeThreads > 1)
+        {
+            // The queue hands out its last entries first
+            reverse(vChecks.begin(), vChecks.end());
+            CCheckQueueControl<CStakeKernelCheck> control(&stakecheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+        }
+        else
+        {
+            BOOST_FOREACH(CStakeKernelCheck& check, vChecks)
+                if (!check())
                     break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
+        }
+
+        for (unsigned int c = 0; c < nChunks && !fKernelFound; c++)
+        {
+            if (!vfChecked[c] || vfTried[c])
+                continue;
+            vfTried[c] = 1;
+            nKernelsChecked += vvfKernel[c].size();
+            for (unsigned int i = c * STAKE_KERNEL_BATCH_COINS; i < min((unsigned int)vStakeCoins.size(), (c + 1) * STAKE_KERNEL_BATCH_COINS) && !fKernelFound; i++)
+            {
+                const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vStakeCoins[i];
+                for (unsigned int n=0; n<nSearchTimes; n++)
                 {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
+                    if (vvfKernel[c][(i - c * STAKE_KERNEL_BATCH_COINS) * nSearchTimes + n])
                     {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
+                        // Found a kernel
+                        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+                        vector<valtype> vSolutions;
+                        txnouttype whichType;
+                        CScript scriptPubKeyOut;
+                        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+                        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+                        {
+                            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+                            break;
+                        }
+                        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+                        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+                        {
+                            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+                            break;  // only support pay to public key and pay to address
+                        }
+                        if (whichType == TX_PUBKEYHASH) // pay to address type
+                        {
+                            // convert to pay to public key type
+                            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+                            {
+                                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                                break;  // unable to find corresponding public key
+                            }
+                            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+                        }
+                        if (whichType == TX_PUBKEY)
+                        {
+                            valtype& vchPubKey = vSolutions[0];
+                            if (!keystore.GetKey(Hash160(vchPubKey), key))
+                            {
+                                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                                break;  // unable to find corresponding public key
+                            }
 
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+                            if (key.GetPubKey() != vchPubKey)
+                            {
+                                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                                break; // keys mismatch
+                            }
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+                            scriptPubKeyOut = scriptPubKeyKernel;
+                        }
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+                        txNew.nTime -= n;
+                        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+                        nCredit += pcoin.first->vout[pcoin.second].nValue;
+                        vwtxPrev.push_back(pcoin.first);
+                        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+                        fKernelFound = true;
+                        break;
+                    }
+                }
             }
         }
-
-        if (fKernelFound)
-            break; // if kernel is found stop searching
     }
 
+    int64_t nSearchTime = GetTimeMicros() - nSearchStart;
+    if (nSearchTime > 0)
+        dKernelsPerSec = nKernelsChecked * 1000000.0 / nSearchTime;
+    LogPrint("coinstake", "CreateCoinStake : checked %u kernels in %dms (%.0f/s) on %d threads\n",
+        nKernelsChecked, nSearchTime / 1000, dKernelsPerSec, nStakeThreads);
+
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
@@ -2389,7 +2506,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
             mapKeyBirth[it->first] = it->second.nCreateTime;
 
     // map in which we'll infer heights of other keys
-    CBlockIndex *pindexMax = FindBlockByHeight(std::max(0, nBestHeight - 144)); // the tip can be reorganised; use a 144-block safety margin
+    CBlockIndex *pindexMax = chainActive[std::max(0, nBestHeight - 144)]; // the tip can be reorganised; use a 144-block safety margin
     std::map<CKeyID, CBlockIndex*> mapKeyFirstBlock;
     std::set<CKeyID> setKeys;
     GetKeys(setKeys);
@@ -2408,7 +2525,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
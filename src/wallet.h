@@ -24,6 +24,11 @@
 extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
+extern int nStakeThreads;
+extern double dKernelsPerSec;
+
+/** Maximum number of threads CreateCoinStake searches kernels on */
+static const int MAX_STAKE_THREADS = 16;
 extern bool fWalletUnlockStakingOnly;
 extern bool fConfChange;
 
@@ -34,6 +39,9 @@ class CReserveKey;
 class COutput;
 class CWalletDB;
 
+/** Worker thread of the -stakethreads kernel search */
+void ThreadStakeCheck();
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {